@@ -0,0 +1,1499 @@
+// Benchmarks for the drawing primitives and the element tree.
+// Usage: toy_bench [--json results.json] [--max-elements N]
+// With --json, every result is also written out as machine-readable JSON.
+
+#define TOY_NO_DEMO
+#include "main.c"
+
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+double _BenchTime() {
+#ifdef _WIN32
+	return _TimeMicroseconds() * 1e-6; // TIME_UTC is the wall clock, which can jump.
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
+
+typedef struct BenchResult {
+	const char *group;
+	char name[32];
+	const char *variant, *metric;
+	double value;
+} BenchResult;
+
+BenchResult *benchResults;
+size_t benchResultCount, benchResultCapacity;
+
+void BenchRecord(const char *group, const char *name, const char *variant, const char *metric, double value) {
+	if (benchResultCount == benchResultCapacity) {
+		benchResultCapacity = benchResultCapacity ? benchResultCapacity * 2 : 64;
+		benchResults = (BenchResult *) realloc(benchResults, benchResultCapacity * sizeof(BenchResult));
+	}
+
+	BenchResult *result = &benchResults[benchResultCount++];
+	result->group = group;
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->variant = variant;
+	result->metric = metric;
+	result->value = value;
+}
+
+bool BenchWriteJSON(const char *path) {
+	FILE *file = fopen(path, "wb");
+	if (!file) return false;
+	const char *kernel = "scalar";
+
+	for (uintptr_t i = 0; i < sizeof(_drawKernels) / sizeof(_drawKernels[0]); i++) {
+		if (_drawKernels[i].fill == _drawFill) kernel = _drawKernels[i].name;
+	}
+
+	fprintf(file, "{\n\t\"kernel\": \"%s\",\n\t\"results\": [\n", kernel);
+
+	for (size_t i = 0; i < benchResultCount; i++) {
+		BenchResult *result = &benchResults[i];
+		fprintf(file, "\t\t{ \"group\": \"%s\", \"name\": \"%s\", \"variant\": \"%s\", \"metric\": \"%s\", \"value\": %.6g }%s\n",
+				result->group, result->name, result->variant, result->metric, result->value, i + 1 == benchResultCount ? "" : ",");
+	}
+
+	fprintf(file, "\t]\n}\n");
+	return fclose(file) == 0;
+}
+
+typedef struct BenchShape {
+	const char *name;
+	int width, height;
+} BenchShape;
+
+void BenchFill(uint32_t *bits, int width, int height) {
+	const BenchShape shapes[] = {
+		{ "full 4K", 3840, 2160 },
+		{ "full 1080p", 1920, 1080 },
+		{ "tile 256x256", 256, 256 },
+		{ "button 120x24", 120, 24 },
+		{ "glyph cell 9x16", 9, 16 },
+		{ "row 3840x1", 3840, 1 },
+		{ "column 1x2160", 1, 2160 },
+	};
+
+	Painter painter;
+	painter.bits = bits;
+	painter.stride = width;
+	painter.height = height;
+	painter.clip = RectangleMake(0, width, 0, height);
+
+	printf("%-16s %-8s %14s\n", "shape", "kernel", "Mpixels/s");
+
+	for (uintptr_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		for (uintptr_t j = 0; j < sizeof(_drawKernels) / sizeof(_drawKernels[0]); j++) {
+			if ((_drawKernels[j].cpuFeatures & _cpuFeatures) != _drawKernels[j].cpuFeatures) {
+				continue;
+			}
+
+			_drawFill = _drawKernels[j].fill;
+
+			// Offset the rectangles by a pixel each time, so that the kernels see unaligned rows too.
+			int cw = width - shapes[i].width + 1, ch = height - shapes[i].height + 1;
+			uint64_t pixels = 0, iterations = 0;
+			double start = _BenchTime(), elapsed;
+
+			do {
+				for (int k = 0; k < 64; k++, iterations++) {
+					int x = iterations % cw, y = iterations % ch;
+					DrawBlock(&painter, RectangleMake(x, x + shapes[i].width, y, y + shapes[i].height), (uint32_t) iterations);
+					pixels += (uint64_t) shapes[i].width * shapes[i].height;
+				}
+
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.25);
+
+			printf("%-16s %-8s %14.1f\n", shapes[i].name, _drawKernels[j].name, pixels / elapsed / 1e6);
+			BenchRecord("fill", shapes[i].name, _drawKernels[j].name, "Mpixels/s", pixels / elapsed / 1e6);
+		}
+	}
+}
+
+// Measures DrawBlock and DrawBlockBlend over the same rectangles, for each kernel.
+void BenchBlend(uint32_t *bits, int width, int height) {
+	const BenchShape shapes[] = {
+		{ "full 1080p", 1920, 1080 },
+		{ "tile 256x256", 256, 256 },
+		{ "button 120x24", 120, 24 },
+	};
+
+	Painter painter;
+	painter.bits = bits;
+	painter.stride = width;
+	painter.height = height;
+	painter.clip = RectangleMake(0, width, 0, height);
+
+	printf("%-16s %-8s %14s %14s\n", "blend", "kernel", "opaque Mpx/s", "blend Mpx/s");
+
+	for (uintptr_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		for (uintptr_t j = 0; j < sizeof(_drawKernels) / sizeof(_drawKernels[0]); j++) {
+			if ((_drawKernels[j].cpuFeatures & _cpuFeatures) != _drawKernels[j].cpuFeatures) {
+				continue;
+			}
+
+			_drawFill = _drawKernels[j].fill;
+			_drawBlend = _drawKernels[j].blend;
+			double rates[2];
+
+			for (int blend = 0; blend < 2; blend++) {
+				int cw = width - shapes[i].width + 1, ch = height - shapes[i].height + 1;
+				uint64_t pixels = 0, iterations = 0;
+				double start = _BenchTime(), elapsed;
+
+				do {
+					for (int k = 0; k < 64; k++, iterations++) {
+						int x = iterations % cw, y = iterations % ch;
+						Rectangle r = RectangleMake(x, x + shapes[i].width, y, y + shapes[i].height);
+						if (blend) DrawBlockBlend(&painter, r, 0x80402010);
+						else DrawBlock(&painter, r, 0x804020);
+						pixels += (uint64_t) shapes[i].width * shapes[i].height;
+					}
+
+					elapsed = _BenchTime() - start;
+				} while (elapsed < 0.25);
+
+				rates[blend] = pixels / elapsed / 1e6;
+			}
+
+			printf("%-16s %-8s %14.1f %14.1f\n", shapes[i].name, _drawKernels[j].name, rates[0], rates[1]);
+			BenchRecord("blend", shapes[i].name, _drawKernels[j].name, "opaque Mpixels/s", rates[0]);
+			BenchRecord("blend", shapes[i].name, _drawKernels[j].name, "blend Mpixels/s", rates[1]);
+		}
+	}
+}
+
+void BenchText(uint32_t *bits, int width, int height) {
+	const char *text = "The quick brown fox jumps over the lazy dog. 0123456789 !?#$%&*()[]{}<>";
+
+	const struct {
+		const char *name;
+		int length, boundsWidth; // The bounds are narrower than the string when clipped.
+	} cases[] = {
+		{ "label 12", 12, 12 * GLYPH_WIDTH },
+		{ "line 72", 72, 72 * GLYPH_WIDTH },
+		{ "clipped 72", 72, 40 * GLYPH_WIDTH + 4 },
+	};
+
+	Painter painter;
+	painter.bits = bits;
+	painter.stride = width;
+	painter.height = height;
+	painter.clip = RectangleMake(0, width, 0, height);
+
+	printf("%-16s %-8s %14s\n", "text", "kernel", "Mglyphs/s");
+
+	for (uintptr_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		for (uintptr_t j = 0; j < sizeof(_drawKernels) / sizeof(_drawKernels[0]); j++) {
+			if ((_drawKernels[j].cpuFeatures & _cpuFeatures) != _drawKernels[j].cpuFeatures) {
+				continue;
+			}
+
+			_drawText = _drawKernels[j].text;
+			uint64_t glyphs = 0, iterations = 0;
+			double start = _BenchTime(), elapsed;
+
+			do {
+				for (int k = 0; k < 256; k++, iterations++) {
+					int x = iterations % 1000, y = (iterations * GLYPH_HEIGHT) % (height - GLYPH_HEIGHT);
+					Rectangle bounds = RectangleMake(x, x + cases[i].boundsWidth, y, y + GLYPH_HEIGHT);
+					DrawString(&painter, bounds, text, cases[i].length, (uint32_t) iterations, true);
+					glyphs += cases[i].length;
+				}
+
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.25);
+
+			printf("%-16s %-8s %14.1f\n", cases[i].name, _drawKernels[j].name, glyphs / elapsed / 1e6);
+			BenchRecord("text", cases[i].name, _drawKernels[j].name, "Mglyphs/s", glyphs / elapsed / 1e6);
+		}
+	}
+}
+
+int BenchCellMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawRectangle((Painter *) dp, element->bounds, 0xE0E0E0, 0x404040);
+		DrawString((Painter *) dp, element->bounds, "Cell", 4, 0x000000, true);
+	} 
+
+	return 0;
+}
+
+int BenchPanelMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawBlock((Painter *) dp, element->bounds, 0xFFCCFF);
+	} else if (message == MSG_LAYOUT) {
+		int columns = 32, width = element->bounds.r - element->bounds.l, height = element->bounds.b - element->bounds.t;
+		int rows = (element->childCount + columns - 1) / columns;
+
+		for (uintptr_t i = 0; i < element->childCount; i++) {
+			int x = element->bounds.l + (i % columns) * width / columns;
+			int y = element->bounds.t + (i / columns) * height / rows;
+			ElementMove(element->children[i], RectangleMake(x + 2, x + width / columns - 2, y + 2, y + height / rows - 2), false);
+		}
+	}
+
+	return 0;
+}
+
+Window *benchWindow;
+Element *benchPanel;
+double benchFrameEnd;
+
+bool BenchFrameFull(uint64_t frame) {
+	(void) frame;
+	ElementRepaint(&benchWindow->e, NULL);
+	return _BenchTime() < benchFrameEnd;
+}
+
+bool BenchFrameCorners(uint64_t frame) {
+	(void) frame;
+	ElementRepaint(benchPanel->children[0], NULL);
+	ElementRepaint(benchPanel->children[benchPanel->childCount - 1], NULL);
+	return _BenchTime() < benchFrameEnd;
+}
+
+void BenchHeadless(int width, int height, int cells) {
+	Initialise();
+	benchWindow = WindowCreate("bench", width, height);
+	benchPanel = ElementCreate(sizeof(Element), &benchWindow->e, 0, BenchPanelMessage);
+
+	for (int i = 0; i < cells; i++) {
+		ElementCreate(sizeof(Element), benchPanel, 0, BenchCellMessage);
+	}
+
+	const struct {
+		const char *name;
+		bool (*frameHandler)(uint64_t frame);
+		bool layer;
+	} modes[] = {
+		{ "full repaint", BenchFrameFull, false },
+		{ "two corners", BenchFrameCorners, false },
+		{ "full, cached", BenchFrameFull, true }, // The panel is static, so each frame should be one blit.
+	};
+
+	printf("headless %dx%d, %d cells\n", width, height, cells);
+
+	for (uintptr_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (modes[i].layer) benchPanel->flags |= ELEMENT_LAYER_CACHE;
+		else benchPanel->flags &= ~ELEMENT_LAYER_CACHE;
+		global.frameHandler = modes[i].frameHandler;
+		global.frameCount = 0;
+		uint64_t hits = global.stats.layerHits, misses = global.stats.layerMisses;
+		double start = _BenchTime();
+		benchFrameEnd = start + 1.0;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+		printf("%-16s %12.1f frames/s %12" PRIu64 " pixels/frame", modes[i].name, global.frameCount / elapsed, global.stats.pixelsPainted);
+		BenchRecord("headless", modes[i].name, "", "frames/s", global.frameCount / elapsed);
+		if (modes[i].layer) printf(" %8" PRIu64 " layer hits %4" PRIu64 " misses", global.stats.layerHits - hits, global.stats.layerMisses - misses);
+		printf("\n");
+	}
+
+	WindowDestroy(benchWindow);
+}
+
+const uint32_t *benchImage;
+int benchImageWidth, benchImageHeight;
+
+int BenchImageMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawImage((Painter *) dp, element->bounds, benchImage, benchImageWidth, benchImageHeight, benchImageWidth, IMAGE_BILINEAR);
+	}
+
+	return 0;
+}
+
+bool BenchFrameImage(uint64_t frame) {
+	(void) frame;
+	ElementRepaint(benchPanel, NULL);
+	return _BenchTime() < benchFrameEnd;
+}
+
+// Measures DrawImage copying and scaling a photo-sized bitmap for each kernel, against drawing it pixel by pixel with DrawBlock.
+void BenchImage(uint32_t *bits, int width, int height) {
+	const struct {
+		const char *name;
+		int width, height, filter;
+	} cases[] = {
+		{ "copy 640x480", 640, 480, IMAGE_NEAREST },
+		{ "nearest 1080p", 1920, 1080, IMAGE_NEAREST },
+		{ "bilinear 1080p", 1920, 1080, IMAGE_BILINEAR },
+		{ "nearest thumb", 160, 120, IMAGE_NEAREST },
+		{ "bilinear thumb", 160, 120, IMAGE_BILINEAR },
+	};
+
+	int imageWidth = 640, imageHeight = 480;
+	uint32_t *image = (uint32_t *) malloc((size_t) imageWidth * imageHeight * 4);
+
+	for (int y = 0; y < imageHeight; y++) {
+		for (int x = 0; x < imageWidth; x++) {
+			image[y * imageWidth + x] = 0xFF000000 | ((x * 255 / imageWidth) << 16) | ((y * 255 / imageHeight) << 8) | ((x ^ y) & 0xFF);
+		}
+	}
+
+	Painter painter;
+	painter.bits = bits;
+	painter.stride = width;
+	painter.height = height;
+	painter.clip = RectangleMake(0, width, 0, height);
+
+	printf("%-16s %-8s %14s\n", "image", "kernel", "Mpixels/s");
+
+	for (uintptr_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		for (uintptr_t j = 0; j < sizeof(_drawKernels) / sizeof(_drawKernels[0]); j++) {
+			if ((_drawKernels[j].cpuFeatures & _cpuFeatures) != _drawKernels[j].cpuFeatures) {
+				continue;
+			}
+
+			_drawImageNearest = _drawKernels[j].imageNearest;
+			_drawImageBilinear = _drawKernels[j].imageBilinear;
+			uint64_t pixels = 0, iterations = 0;
+			double start = _BenchTime(), elapsed;
+
+			do {
+				int x = iterations % (width - cases[i].width + 1), y = iterations % (height - cases[i].height + 1);
+				DrawImage(&painter, RectangleMake(x, x + cases[i].width, y, y + cases[i].height), image, imageWidth, imageHeight, imageWidth, cases[i].filter);
+				pixels += (uint64_t) cases[i].width * cases[i].height, iterations++;
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.25);
+
+			printf("%-16s %-8s %14.1f\n", cases[i].name, _drawKernels[j].name, pixels / elapsed / 1e6);
+			BenchRecord("image", cases[i].name, _drawKernels[j].name, "Mpixels/s", pixels / elapsed / 1e6);
+		}
+	}
+
+	_DrawInitialise();
+
+	{
+		// What callers did before, with a 1x1 block per pixel.
+		uint64_t pixels = 0;
+		double start = _BenchTime(), elapsed;
+
+		do {
+			for (int y = 0; y < imageHeight; y++) {
+				for (int x = 0; x < imageWidth; x++) {
+					DrawBlock(&painter, RectangleMake(x, x + 1, y, y + 1), image[y * imageWidth + x]);
+				}
+			}
+
+			pixels += (uint64_t) imageWidth * imageHeight;
+			elapsed = _BenchTime() - start;
+		} while (elapsed < 0.25);
+
+		printf("%-16s %-8s %14.1f\n", "copy 640x480", "block", pixels / elapsed / 1e6);
+		BenchRecord("image", "copy 640x480", "block", "Mpixels/s", pixels / elapsed / 1e6);
+	}
+
+	// Repainting an ImageDisplay copies its cached scaled pixels, where a plain element filters the image again each time.
+	printf("%-16s %12s\n", "image display", "frames/s");
+	benchImage = image, benchImageWidth = imageWidth, benchImageHeight = imageHeight;
+
+	for (int cached = 0; cached < 2; cached++) {
+		benchWindow = WindowCreate("bench", 1920, 1080);
+		benchPanel = cached ? &ImageDisplayCreate(&benchWindow->e, 0, IMAGE_BILINEAR)->e 
+			: ElementCreate(sizeof(Element), &benchWindow->e, ELEMENT_OPAQUE, BenchImageMessage);
+		if (cached) ImageDisplaySetImage((ImageDisplay *) benchPanel, image, imageWidth, imageHeight, imageWidth);
+		global.frameHandler = BenchFrameImage;
+		global.frameCount = 0;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+		const char *name = cached ? "cached" : "filtered";
+		printf("%-16s %12.1f\n", name, global.frameCount / elapsed);
+		BenchRecord("image display", name, "", "frames/s", global.frameCount / elapsed);
+		WindowDestroy(benchWindow);
+	}
+
+	free(image);
+}
+
+// Stacks of full-size panels, like the pages of a tab control, where only the top one is visible.
+void BenchOcclusion(int width, int height, int pages, int cells) {
+	printf("%-16s %-8s %12s %12s\n", "occlusion", "opaque", "frames/s", "overdraw");
+
+	for (int opaque = 0; opaque < 2; opaque++) {
+		benchWindow = WindowCreate("bench", width, height);
+		Element *stack = ElementCreate(sizeof(Element), &benchWindow->e, 0, NULL);
+		uint32_t flags = opaque ? ELEMENT_OPAQUE : 0;
+
+		for (int i = 0; i < pages; i++) {
+			Element *page = ElementCreate(sizeof(Element), stack, flags, BenchPanelMessage);
+			for (int j = 0; j < cells; j++) ElementCreate(sizeof(Element), page, flags, BenchCellMessage);
+		}
+
+		ElementMove(stack, RectangleMake(0, width, 0, height), false);
+		for (int i = 0; i < pages; i++) ElementMove(stack->children[i], stack->bounds, false);
+		global.frameHandler = BenchFrameFull;
+		global.frameCount = 0;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+		double overdraw = (double) global.stats.pixelsDrawn / global.stats.pixelsPainted;
+
+		char name[32];
+		snprintf(name, sizeof(name), "%d pages", pages);
+		printf("%-16s %-8s %12.1f %12.2f\n", name, opaque ? "yes" : "no", global.frameCount / elapsed, overdraw);
+		BenchRecord("occlusion", name, opaque ? "opaque" : "plain", "frames/s", global.frameCount / elapsed);
+		BenchRecord("occlusion", name, opaque ? "opaque" : "plain", "overdraw", overdraw);
+		WindowDestroy(benchWindow);
+	}
+}
+
+// Lays out the cells in rows of 32, each row 40 pixels high.
+int BenchScrollContentMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	(void) dp;
+
+	if (message == MSG_LAYOUT) {
+		int width = element->bounds.r - element->bounds.l;
+
+		for (uintptr_t i = 0; i < element->childCount; i++) {
+			int x = element->bounds.l + (i % 32) * width / 32, y = element->bounds.t + (i / 32) * 40;
+			ElementMove(element->children[i], RectangleMake(x + 2, x + width / 32 - 2, y + 2, y + 38), false);
+		}
+	}
+
+	return 0;
+}
+
+ScrollPanel *benchScrollPanel;
+int benchScrollStep;
+bool benchScrollBlit;
+
+bool BenchFrameScroll(uint64_t frame) {
+	(void) frame;
+	ScrollPanel *panel = benchScrollPanel;
+	int maximum = panel->contentHeight - (panel->e.bounds.b - panel->e.bounds.t);
+	if (panel->scrollY + benchScrollStep < 0 || panel->scrollY + benchScrollStep > maximum) benchScrollStep = -benchScrollStep;
+
+	if (benchScrollBlit) {
+		ScrollPanelScrollTo(panel, panel->scrollX, panel->scrollY + benchScrollStep);
+	} else {
+		// Move the content and repaint the whole viewport, as scrolling worked before.
+		panel->scrollY += benchScrollStep;
+		ElementRelayout(&panel->e);
+		ElementRepaint(&panel->e, NULL);
+	}
+
+	return _BenchTime() < benchFrameEnd;
+}
+
+// Scrolls a panel of cells by one mouse wheel notch per frame.
+void BenchScroll(int width, int height, int cells) {
+	printf("%-16s %12s %14s\n", "scroll", "frames/s", "pixels/frame");
+
+	for (int blit = 0; blit < 2; blit++) {
+		benchWindow = WindowCreate("bench", width, height);
+		benchScrollPanel = ScrollPanelCreate(&benchWindow->e, 0, 0xFFFFFF);
+		Element *content = ElementCreate(sizeof(Element), &benchScrollPanel->e, 0, BenchScrollContentMessage);
+		for (int i = 0; i < cells; i++) ElementCreate(sizeof(Element), content, 0, BenchCellMessage);
+		ScrollPanelSetContentSize(benchScrollPanel, width, (cells + 31) / 32 * 40);
+		benchScrollStep = 40;
+		benchScrollBlit = blit;
+		global.frameHandler = BenchFrameScroll;
+		global.frameCount = 0;
+		uint64_t pixels = global.stats.pixelsPaintedTotal;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+		double perFrame = (double) (global.stats.pixelsPaintedTotal - pixels) / global.frameCount;
+		const char *name = blit ? "blit" : "repaint";
+		printf("%-16s %12.1f %14.0f\n", name, global.frameCount / elapsed, perFrame);
+		BenchRecord("scroll", name, "", "frames/s", global.frameCount / elapsed);
+		BenchRecord("scroll", name, "", "pixels/frame", perFrame);
+		WindowDestroy(benchWindow);
+	}
+}
+
+// Lays the cells out in fixed 60x40 slots from the top left, so resizing doesn't move them.
+int BenchResizeContentMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawBlock((Painter *) dp, element->bounds, 0xFFFFFF);
+	} else if (message == MSG_LAYOUT) {
+		for (uintptr_t i = 0; i < element->childCount; i++) {
+			int x = element->bounds.l + (i % 64) * 60, y = element->bounds.t + (i / 64) * 40;
+			ElementMove(element->children[i], RectangleMake(x + 2, x + 58, y + 2, y + 38), false);
+		}
+	}
+
+	return 0;
+}
+
+int benchResizeStep, benchResizeReallocations;
+bool benchResizeBounce;
+uint32_t *benchResizeScreen; // What has been presented, benchResizeScreenStride pixels to a row.
+int benchResizeScreenStride;
+bool benchResizeCheck;
+uint64_t benchResizeStale;
+
+void BenchResizePresentHandler(Window *window, const uint32_t *bits, int stride, DamageRegion *region) {
+	(void) window;
+
+	for (int i = 0; i < region->count; i++) {
+		Rectangle r = region->rectangles[i];
+
+		for (int y = r.t; y < r.b; y++) {
+			memcpy(benchResizeScreen + (size_t) y * benchResizeScreenStride + r.l, bits + (size_t) y * stride + r.l, (r.r - r.l) * 4);
+		}
+	}
+}
+
+// Drags the bottom right corner back and forth between 1280x720 and the full size.
+// To bounce, each frame first resizes to half of its size, like ConfigureNotify events arriving faster than frames are painted.
+// The framebuffer shrinks to fit, and keeps only the smaller window's pixels when it grows back.
+// Counts the pixels presented in the region that differ from a fresh paint of the window.
+uint64_t BenchResizeCountStale(DamageRegion *region) {
+	int width = benchWindow->width, height = benchWindow->height;
+	uint32_t *fresh = (uint32_t *) malloc((size_t) width * height * 4);
+	Painter painter = { 0 };
+	painter.bits = fresh;
+	painter.stride = width;
+	painter.height = height;
+	_WindowLayout(benchWindow);
+	uint64_t stale = 0;
+
+	for (int i = 0; i < region->count; i++) {
+		Rectangle r = painter.clip = RectangleIntersection(region->rectangles[i], benchWindow->e.bounds);
+		if (!RectangleValid(r)) continue;
+		_ElementPaint(&benchWindow->e, &painter);
+
+		for (int y = r.t; y < r.b; y++) {
+			for (int x = r.l; x < r.r; x++) {
+				stale += benchResizeScreen[(size_t) y * benchResizeScreenStride + x] != fresh[(size_t) y * width + x];
+			}
+		}
+	}
+
+	free(fresh);
+	return stale;
+}
+
+// Like the X server with NorthWestGravity, whatever the window grew into is then exposed.
+// With benchResizeCheck, the exposed pixels are checked as soon as they're presented, for a fixed number of frames.
+bool BenchFrameResize(uint64_t frame) {
+	int range = 160, step = (int) (frame % (2 * range));
+	if (step >= range) step = 2 * range - step;
+	int width = 1280 + step * benchResizeStep * 16 / 9, height = 720 + step * benchResizeStep;
+	int keptWidth = benchWindow->width, keptHeight = benchWindow->height;
+
+	for (int bounce = benchResizeBounce; bounce >= 0; bounce--) {
+		uint32_t *bits = benchWindow->bits;
+		_WindowResize(benchWindow, width >> bounce, height >> bounce);
+		if (benchWindow->bits != bits) benchResizeReallocations++;
+		if (keptWidth > benchWindow->width) keptWidth = benchWindow->width;
+		if (keptHeight > benchWindow->height) keptHeight = benchWindow->height;
+	}
+
+	DamageRegion exposed = { 0 };
+	DamageAdd(&exposed, RectangleMake(keptWidth, width, 0, height));
+	DamageAdd(&exposed, RectangleMake(0, keptWidth, keptHeight, height));
+
+	if (exposed.count) {
+		_WindowExpose(benchWindow, &exposed);
+		if (benchResizeCheck) benchResizeStale += BenchResizeCountStale(&exposed);
+	}
+
+	return benchResizeCheck ? frame < 80 : _BenchTime() < benchFrameEnd;
+}
+
+// Live-resizes a window, with and without ELEMENT_RESIZE_KEEPS_PIXELS on its content.
+// Afterwards, some more frames check that exposes present painted pixels,
+// and then what was presented is compared against a full repaint, to count pixels left stale by painting only the exposed strips.
+void BenchResize(int cells) {
+	const struct {
+		const char *name;
+		bool keep, bounce;
+	} cases[] = {
+		{ "repaint", false, false },
+		{ "strips", true, false },
+		{ "strips bounce", true, true },
+	};
+
+	printf("%-16s %12s %14s %14s %12s\n", "resize", "frames/s", "pixels/frame", "reallocations", "stale");
+	benchResizeScreenStride = 1280 + 160 * 2 * 16 / 9;
+	benchResizeScreen = (uint32_t *) calloc((size_t) benchResizeScreenStride * (720 + 160 * 2), 4);
+	global.presentHandler = BenchResizePresentHandler;
+
+	for (uintptr_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		benchWindow = WindowCreate("bench", 1280, 720);
+		Element *content = ElementCreate(sizeof(Element), &benchWindow->e, ELEMENT_OPAQUE | (cases[i].keep ? ELEMENT_RESIZE_KEEPS_PIXELS : 0), 
+				BenchResizeContentMessage);
+		for (int j = 0; j < cells; j++) ElementCreate(sizeof(Element), content, 0, BenchCellMessage);
+		benchResizeStep = 2;
+		benchResizeBounce = cases[i].bounce;
+		benchResizeReallocations = 0;
+		global.frameHandler = BenchFrameResize;
+		global.frameCount = 0;
+		uint64_t pixels = global.stats.pixelsPaintedTotal;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+		double perFrame = (double) (global.stats.pixelsPaintedTotal - pixels) / global.frameCount;
+		double rate = global.frameCount / elapsed;
+		int reallocations = benchResizeReallocations;
+
+		benchResizeCheck = true;
+		benchResizeStale = 0;
+		global.frameCount = 0;
+		MessageLoop();
+		benchResizeCheck = false;
+
+		_Update(); // Paint the last frame's damage.
+		int width = benchWindow->width, height = benchWindow->height, stride = benchWindow->stride;
+		uint32_t *before = (uint32_t *) malloc((size_t) width * height * 4);
+
+		for (int y = 0; y < height; y++) {
+			memcpy(before + (size_t) y * width, benchResizeScreen + (size_t) y * benchResizeScreenStride, (size_t) width * 4);
+		}
+
+		ElementRepaint(&benchWindow->e, NULL);
+		_Update();
+		uint64_t stale = benchResizeStale;
+
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				stale += before[y * width + x] != benchWindow->bits[y * stride + x];
+			}
+		}
+
+		free(before);
+		printf("%-16s %12.1f %14.0f %14d %12" PRIu64 "\n", cases[i].name, rate, perFrame, reallocations, stale);
+		BenchRecord("resize", cases[i].name, "", "frames/s", rate);
+		BenchRecord("resize", cases[i].name, "", "pixels/frame", perFrame);
+		BenchRecord("resize", cases[i].name, "", "reallocations", reallocations);
+		BenchRecord("resize", cases[i].name, "", "stale pixels", (double) stale);
+		WindowDestroy(benchWindow);
+	}
+
+	global.presentHandler = NULL;
+	free(benchResizeScreen);
+}
+
+void BenchListRow(VirtualList *list, Painter *painter, Rectangle bounds, uint64_t row) {
+	char label[24];
+	int bytes = snprintf(label, sizeof(label), "Row %" PRIu64, row);
+	DrawBlock(painter, bounds, row == (uint64_t) list->hoveredRow ? 0xCCE0FF : (row & 1) ? 0xF0F0F0 : 0xFFFFFF);
+	DrawString(painter, bounds, label, bytes, 0x000000, false);
+}
+
+VirtualList *benchList;
+
+bool BenchFrameListFull(uint64_t frame) {
+	(void) frame;
+	ElementRepaint(&benchList->e, NULL);
+	return _BenchTime() < benchFrameEnd;
+}
+
+bool BenchFrameListScroll(uint64_t frame) {
+	(void) frame;
+	uint64_t scroll = benchList->scroll;
+	if (benchScrollStep < 0 && scroll < (uint64_t) -benchScrollStep) benchScrollStep = -benchScrollStep;
+	VirtualListScrollTo(benchList, scroll + benchScrollStep);
+	if (benchList->scroll == scroll) benchScrollStep = -benchScrollStep; // Reached the end.
+	return _BenchTime() < benchFrameEnd;
+}
+
+// The costs should stay the same however many rows there are.
+void BenchVirtualList(int width, int height) {
+	const uint64_t counts[] = { 100, 10000, 1000000, 10000000 };
+	printf("%-16s %12s %12s %14s\n", "virtual list", "repaint/s", "scroll/s", "Mqueries/s");
+
+	for (uintptr_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		benchWindow = WindowCreate("bench", width, height);
+		benchList = VirtualListCreate(&benchWindow->e, 0, 20, BenchListRow, 0xFFFFFF);
+		VirtualListSetRowCount(benchList, counts[i]);
+		double rates[2];
+
+		for (int scroll = 0; scroll < 2; scroll++) {
+			global.frameHandler = scroll ? BenchFrameListScroll : BenchFrameListFull;
+			benchScrollStep = 40;
+			global.frameCount = 0;
+			double start = _BenchTime();
+			benchFrameEnd = start + 0.25;
+			MessageLoop();
+			rates[scroll] = global.frameCount / (_BenchTime() - start);
+		}
+
+		uint64_t queries = 0, found = 0;
+		double start = _BenchTime(), elapsed;
+
+		do {
+			for (int k = 0; k < 4096; k++, queries++) {
+				found += VirtualListRowAt(benchList, (int) (queries * 7 % width), (int) (queries * 13 % height)) >= 0;
+			}
+
+			elapsed = _BenchTime() - start;
+		} while (elapsed < 0.25);
+
+		char name[32];
+		snprintf(name, sizeof(name), "%" PRIu64 " rows", counts[i]);
+		printf("%-16s %12.1f %12.1f %14.1f\n", name, rates[0], rates[1], queries / elapsed / 1e6);
+		BenchRecord("virtual list", name, "", "repaints/s", rates[0]);
+		BenchRecord("virtual list", name, "", "scrolls/s", rates[1]);
+		BenchRecord("virtual list", name, "", "Mqueries/s", queries / elapsed / 1e6);
+		if (!found) printf("(no rows found)\n");
+		WindowDestroy(benchWindow);
+	}
+}
+
+uint32_t *benchScreen;
+
+// Stands in for a display connection: copies the pixels, then waits as if sending them at 4 bytes per nanosecond.
+void BenchPresentHandler(Window *window, const uint32_t *bits, int stride, DamageRegion *region) {
+	uint64_t pixels = 0;
+
+	for (int i = 0; i < region->count; i++) {
+		Rectangle r = region->rectangles[i];
+		pixels += _RectangleArea(r);
+
+		for (int y = r.t; y < r.b; y++) {
+			memcpy(benchScreen + (size_t) y * window->width + r.l, bits + (size_t) y * stride + r.l, (r.r - r.l) * 4);
+		}
+	}
+
+#ifndef _WIN32
+	struct timespec wait = { 0, (long) pixels };
+	nanosleep(&wait, NULL);
+#endif
+}
+
+bool BenchFrameInput(uint64_t frame) {
+	// Each frame answers a mouse move.
+	benchWindow->cursorX = (int) (frame % benchWindow->width);
+	benchWindow->cursorY = (int) (frame % benchWindow->height);
+	_WindowInputEvent(benchWindow, MSG_MOUSE_MOVE, 0, 0);
+	ElementRepaint(&benchWindow->e, NULL);
+	return _BenchTime() < benchFrameEnd;
+}
+
+// Full repaints with a slow present, presented from _Update or from the present thread.
+void BenchPresent(int width, int height, int cells) {
+	const int bufferCounts[] = { 0, 2, 3 };
+	printf("%-16s %12s %12s\n", "present", "frames/s", "latency ms");
+	benchWindow = WindowCreate("bench", width, height);
+	benchPanel = ElementCreate(sizeof(Element), &benchWindow->e, 0, BenchPanelMessage);
+	for (int i = 0; i < cells; i++) ElementCreate(sizeof(Element), benchPanel, 0, BenchCellMessage);
+	benchScreen = (uint32_t *) malloc((size_t) width * height * 4);
+	global.presentHandler = BenchPresentHandler;
+
+	for (uintptr_t i = 0; i < sizeof(bufferCounts) / sizeof(bufferCounts[0]); i++) {
+		PresentThreadEnable(bufferCounts[i]);
+		global.frameHandler = BenchFrameInput;
+		global.frameCount = 0;
+		uint64_t latency = global.stats.inputLatencyTotal, latencyFrames = global.stats.inputLatencyFrames;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		_PresentFlush();
+		double elapsed = _BenchTime() - start;
+		double averageLatency = (double) (global.stats.inputLatencyTotal - latency) / (global.stats.inputLatencyFrames - latencyFrames) / 1e3;
+
+		char name[32];
+		if (bufferCounts[i]) snprintf(name, sizeof(name), "thread, %d buffers", bufferCounts[i]);
+		else snprintf(name, sizeof(name), "synchronous");
+		printf("%-16s %12.1f %12.2f\n", name, global.frameCount / elapsed, averageLatency);
+		BenchRecord("present", name, "", "frames/s", global.frameCount / elapsed);
+		BenchRecord("present", name, "", "latency ms", averageLatency);
+	}
+
+	PresentThreadEnable(0);
+	global.presentHandler = NULL;
+	WindowDestroy(benchWindow);
+	free(benchScreen);
+}
+
+bool benchTimerUpdateEach;
+
+// A cell that blinks on a timer.
+int BenchBlinkMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawBlock((Painter *) dp, element->bounds, (uint32_t) (uintptr_t) element->cp);
+	} else if (message == MSG_TIMER) {
+		element->cp = (void *) (uintptr_t) ((uintptr_t) element->cp ^ 0xFFFFFF);
+		ElementRepaint(element, NULL);
+		if (benchTimerUpdateEach) _Update();
+	}
+
+	return 0;
+}
+
+// Animating cells on 16 ms timers, with the clock stepped a tick at a time.
+void BenchTimers(int width, int height, int cells) {
+	printf("%-16s %-8s %12s %14s\n", "timers", "updates", "ms/tick", "frames/tick");
+
+	for (int each = 0; each < 2; each++) {
+		benchWindow = WindowCreate("bench", width, height);
+		benchPanel = ElementCreate(sizeof(Element), &benchWindow->e, 0, BenchPanelMessage);
+		for (int i = 0; i < cells; i++) ElementStartTimer(ElementCreate(sizeof(Element), benchPanel, 0, BenchBlinkMessage), 16, true);
+		ElementMove(benchPanel, RectangleMake(0, width, 0, height), false);
+		_WindowLayout(benchWindow);
+		_Update();
+		benchTimerUpdateEach = each;
+
+		const int ticks = 60;
+		uint64_t clock = _TimeMicroseconds(), frames = global.stats.frames;
+		double start = _BenchTime();
+
+		for (int i = 1; i <= ticks; i++) {
+			_TimersFire(clock + i * 16000);
+			_Update();
+		}
+
+		double elapsed = _BenchTime() - start;
+		double framesPerTick = (double) (global.stats.frames - frames) / ticks;
+		const char *variant = each ? "each" : "batched";
+		char name[32];
+		snprintf(name, sizeof(name), "%d cells", cells);
+		printf("%-16s %-8s %12.3f %14.1f\n", name, variant, elapsed / ticks * 1e3, framesPerTick);
+		BenchRecord("timers", name, variant, "ms/tick", elapsed / ticks * 1e3);
+		BenchRecord("timers", name, variant, "frames/tick", framesPerTick);
+		WindowDestroy(benchWindow);
+	}
+
+	benchTimerUpdateEach = false;
+}
+
+// A cell that highlights itself under the cursor.
+int BenchHoverMessage(Element *element, Message message, int di, void *dp) {
+	if (message == MSG_PAINT) {
+		DrawRectangle((Painter *) dp, element->bounds, element->window->hovered == element ? 0xFFE080 : 0xE0E0E0, 0x404040);
+	} else if (message == MSG_UPDATE && di == UPDATE_HOVERED) {
+		ElementRepaint(element, NULL);
+	}
+
+	return 0;
+}
+
+// Records the cursor sweeping over hover cells, with a resize halfway, then replays it as fast as possible and in real time.
+void BenchReplay(int width, int height, int cells) {
+	printf("%-16s %-10s %8s %8s %8s %8s %8s\n", "replay", "timing", "frames", "p50 us", "p90 us", "p99 us", "max us");
+	benchWindow = WindowCreate("bench", width, height);
+	benchPanel = ElementCreate(sizeof(Element), &benchWindow->e, 0, BenchPanelMessage);
+	for (int i = 0; i < cells; i++) ElementCreate(sizeof(Element), benchPanel, 0, BenchHoverMessage);
+	ElementMove(benchPanel, RectangleMake(0, width, 0, height), false);
+	_WindowLayout(benchWindow);
+	_Update();
+
+	FILE *file = tmpfile();
+	const int events = 400;
+	if (!file || !InputRecordStart(file)) return;
+
+	for (int i = 0; i < events; i++) {
+		if (i == events / 2) WindowResize(benchWindow, width * 3 / 4, height * 3 / 4);
+		benchWindow->cursorX = i * benchWindow->width / events;
+		benchWindow->cursorY = i * benchWindow->height / events;
+		_WindowInputEvent(benchWindow, MSG_MOUSE_MOVE, 0, 0);
+		_Update();
+#ifndef _WIN32
+		struct timespec wait = { 0, 1000000 };
+		nanosleep(&wait, NULL);
+#endif
+	}
+
+	InputRecordStop();
+	long bytes = ftell(file);
+
+	for (int realTime = 0; realTime < 2; realTime++) {
+		WindowResize(benchWindow, width, height);
+		_Update();
+		rewind(file);
+		InputReplayReport report;
+		if (!InputReplay(file, realTime, &report)) break;
+
+		char name[32];
+		snprintf(name, sizeof(name), "%d moves", events);
+		const char *variant = realTime ? "real time" : "fast";
+		printf("%-16s %-10s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", name, variant, report.frames,
+				report.latencyP50, report.latencyP90, report.latencyP99, report.latencyMax);
+		BenchRecord("replay", name, variant, "p50 us", (double) report.latencyP50);
+		BenchRecord("replay", name, variant, "p90 us", (double) report.latencyP90);
+		BenchRecord("replay", name, variant, "p99 us", (double) report.latencyP99);
+		BenchRecord("replay", name, variant, "max us", (double) report.latencyMax);
+	}
+
+	printf("(%ld bytes recorded)\n", bytes);
+	fclose(file);
+	WindowDestroy(benchWindow);
+}
+
+void BenchHitTest(int width, int height) {
+	printf("%-16s %-8s %14s\n", "hit-test", "index", "Mqueries/s");
+
+	for (int count = 100; count <= 100000; count *= 10) {
+		for (int indexed = 0; indexed < 2; indexed++) {
+			Element *root = ElementCreate(sizeof(Element), NULL, indexed ? ELEMENT_SPATIAL_INDEX : 0, NULL);
+			root->bounds = root->clip = RectangleMake(0, width, 0, height);
+			int columns = 1;
+			while (columns * columns < count) columns++;
+			int rows = (count + columns - 1) / columns;
+
+			for (int i = 0; i < count; i++) {
+				Element *child = ElementCreate(sizeof(Element), root, 0, NULL);
+				int x = i % columns * width / columns, y = i / columns * height / rows;
+				ElementMove(child, RectangleMake(x + 1, (i % columns + 1) * width / columns - 1, y + 1, (i / columns + 1) * height / rows - 1), false);
+			}
+
+			uint64_t queries = 0, hits = 0;
+			uint32_t random = 1;
+			double start = _BenchTime(), elapsed;
+
+			do {
+				for (int k = 0; k < 256; k++, queries++) {
+					random = random * 1103515245 + 12345;
+					hits += ElementFindByPoint(root, (random >> 8) % width, (random >> 4) % height) != root;
+				}
+
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.25);
+
+			char name[32];
+			snprintf(name, sizeof(name), "%d children", count);
+			printf("%-16s %-8s %14.3f\n", name, indexed ? "grid" : "linear", queries / elapsed / 1e6);
+			BenchRecord("hit-test", name, indexed ? "grid" : "linear", "Mqueries/s", queries / elapsed / 1e6);
+			ElementDestroy(root);
+		}
+	}
+}
+
+// Builds groups children under root, each with perGroup children of its own, laid out in rows.
+void BenchBuildTree(Element *root, int groups, int perGroup) {
+	int width = root->bounds.r - root->bounds.l, height = root->bounds.b - root->bounds.t;
+
+	for (int i = 0; i < groups; i++) {
+		Element *group = ElementCreate(sizeof(Element), root, 0, NULL);
+		ElementMove(group, RectangleMake(0, width, i * height / groups, (i + 1) * height / groups), false);
+
+		for (int j = 0; j < perGroup; j++) {
+			Element *child = ElementCreate(sizeof(Element), group, 0, NULL);
+			int x = (int) ((int64_t) j * width / perGroup);
+			ElementMove(child, RectangleMake(x, x + 1, group->bounds.t, group->bounds.b), false);
+		}
+	}
+}
+
+void BenchTree() {
+	const struct {
+		const char *name;
+		int groups, perGroup;
+	} shapes[] = {
+		{ "wide 1x100k", 1, 100000 },
+		{ "nested 100x1k", 100, 1000 },
+		{ "nested 1kx100", 1000, 100 },
+	};
+
+	printf("%-16s %-8s %10s %10s %10s\n", "tree", "alloc", "build ms", "paint ms", "free ms");
+
+	for (uintptr_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		for (int pooled = 0; pooled < 2; pooled++) {
+			// Elements under a window come from its pool; a root without a window uses calloc.
+			Window *window = pooled ? WindowCreate("bench", 100000, 1) : NULL;
+			Element *root = ElementCreate(sizeof(Element), pooled ? &window->e : NULL, 0, NULL);
+			root->bounds = root->clip = RectangleMake(0, 100000, 0, 1000);
+
+			double start = _BenchTime();
+			BenchBuildTree(root, shapes[i].groups, shapes[i].perGroup);
+			double built = _BenchTime();
+
+			Painter painter = { 0 };
+			painter.clip = root->clip;
+			int passes = 10;
+			for (int k = 0; k < passes; k++) _ElementPaint(root, &painter);
+			double painted = _BenchTime();
+
+			ElementDestroy(root);
+			double freed = _BenchTime();
+			if (window) WindowDestroy(window);
+
+			printf("%-16s %-8s %10.2f %10.2f %10.2f\n", shapes[i].name, pooled ? "pool" : "calloc", 
+					(built - start) * 1e3, (painted - built) * 1e3 / passes, (freed - painted) * 1e3);
+			BenchRecord("tree", shapes[i].name, pooled ? "pool" : "calloc", "build ms", (built - start) * 1e3);
+			BenchRecord("tree", shapes[i].name, pooled ? "pool" : "calloc", "paint ms", (painted - built) * 1e3 / passes);
+			BenchRecord("tree", shapes[i].name, pooled ? "pool" : "calloc", "free ms", (freed - painted) * 1e3);
+		}
+	}
+}
+
+// Counts last level cache misses in this thread, where the kernel exposes the hardware counters.
+int BenchCacheMissesOpen() {
+#ifdef __linux__
+	struct perf_event_attr attributes = { 0 };
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+	attributes.exclude_kernel = attributes.exclude_hv = 1;
+	return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+uint64_t BenchCacheMissesRead(int counter) {
+	uint64_t count = 0;
+	if (counter < 0 || read(counter, &count, sizeof(count)) != sizeof(count)) return 0;
+	return count;
+}
+
+// Hit tests and small repaints over trees of a million elements, where the traversal itself dominates.
+void BenchTraversal(int count) {
+	const struct {
+		const char *name;
+		int groups;
+	} shapes[] = {
+		{ "wide", 1 },
+		{ "grouped", 1000 },
+	};
+
+	int counter = BenchCacheMissesOpen();
+	printf("%-16s %-8s %12s %14s\n", "traversal", "walk", "us/walk", "misses/walk");
+
+	for (uintptr_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		Window *window = WindowCreate("bench", 100000, 1);
+		Element *root = ElementCreate(sizeof(Element), &window->e, 0, NULL);
+		root->bounds = root->clip = RectangleMake(0, 100000, 0, 1000);
+		BenchBuildTree(root, shapes[i].groups, count / shapes[i].groups);
+
+		for (int paint = 0; paint < 2; paint++) {
+			uint64_t walks = 0, misses = BenchCacheMissesRead(counter);
+			uint32_t random = 1;
+			Painter painter = { 0 };
+			double start = _BenchTime(), elapsed;
+
+			do {
+				random = random * 1103515245 + 12345;
+				int x = (random >> 8) % 100000, y = (random >> 4) % 1000;
+
+				if (paint) {
+					painter.clip = RectangleMake(x, x + 256, y, y + 256);
+					_ElementPaint(root, &painter);
+				} else {
+					ElementFindByPoint(root, x, y);
+				}
+
+				walks++;
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.25);
+
+			misses = BenchCacheMissesRead(counter) - misses;
+			char name[32], missText[32] = "n/a";
+			snprintf(name, sizeof(name), "%s %d", shapes[i].name, count);
+			if (counter >= 0) snprintf(missText, sizeof(missText), "%.0f", (double) misses / walks);
+			const char *variant = paint ? "paint" : "hit-test";
+			printf("%-16s %-8s %12.2f %14s\n", name, variant, elapsed / walks * 1e6, missText);
+			BenchRecord("traversal", name, variant, "us/walk", elapsed / walks * 1e6);
+			if (counter >= 0) BenchRecord("traversal", name, variant, "misses/walk", (double) misses / walks);
+		}
+
+		WindowDestroy(window);
+	}
+
+	if (counter >= 0) close(counter);
+}
+
+void BenchParallel(int width, int height, int cells) {
+	Window *window = WindowCreate("bench", width, height);
+	benchWindow = window;
+	benchPanel = ElementCreate(sizeof(Element), &window->e, 0, BenchPanelMessage);
+
+	for (int i = 0; i < cells; i++) {
+		ElementCreate(sizeof(Element), benchPanel, 0, BenchCellMessage);
+	}
+
+	ElementMessage(&window->e, MSG_LAYOUT, 0, NULL);
+	global.frameHandler = BenchFrameFull;
+#ifdef _WIN32
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	int processors = systemInfo.dwNumberOfProcessors;
+#else
+	int processors = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	printf("%-16s %-8s %14s (%d processors)\n", "parallel paint", "threads", "frames/s", processors);
+
+	// Go one step past the processor count, to show the cost of oversubscription.
+	for (int threads = 1; threads <= PARALLEL_MAX_THREADS && threads <= processors * 2; threads *= 2) {
+		ParallelPaintEnable(threads);
+		global.frameCount = 0;
+		double start = _BenchTime();
+		benchFrameEnd = start + 0.5;
+		MessageLoop();
+		double elapsed = _BenchTime() - start;
+
+		char name[32];
+		snprintf(name, sizeof(name), "%dx%d", width, height);
+		printf("%-16s %-8d %14.1f\n", name, threads, global.frameCount / elapsed);
+		char variant[24];
+		snprintf(variant, sizeof(variant), "%d threads", threads);
+		BenchRecord("parallel", name, variant, "frames/s", global.frameCount / elapsed);
+	}
+
+	ParallelPaintEnable(1);
+	WindowDestroy(window);
+}
+
+Window *BenchFindWindowLinear(uintptr_t handle) {
+	// What event dispatch used to do: check every window in turn.
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		if ((uintptr_t) global.windows[i]->e.cp == handle) {
+			return global.windows[i];
+		}
+	}
+
+	return NULL;
+}
+
+void BenchWindowLookup() {
+	printf("%-16s %-8s %14s\n", "window lookup", "method", "ns/event");
+
+	for (int count = 1; count <= 1000; count *= 10) {
+		// X servers hand out resource IDs sequentially from a per-client base; emulate that.
+		WindowMap map = { 0 };
+		Window **windows = (Window **) malloc(count * sizeof(Window *));
+
+		for (int i = 0; i < count; i++) {
+			windows[i] = WindowCreate("bench", 1, 1);
+			windows[i]->e.cp = (void *) (uintptr_t) (0x3C00001 + i * 3);
+			_WindowMapInsert(&map, (uintptr_t) windows[i]->e.cp, windows[i]);
+		}
+
+		for (int method = 0; method < 2; method++) {
+			uint64_t lookups = 0, found = 0;
+			uint32_t random = 1;
+			double start = _BenchTime(), elapsed;
+
+			do {
+				for (int k = 0; k < 1024; k++, lookups++) {
+					random = random * 1103515245 + 12345;
+					uintptr_t handle = 0x3C00001 + (random >> 8) % count * 3;
+					found += (method ? _WindowMapFind(&map, handle) : BenchFindWindowLinear(handle)) != NULL;
+				}
+
+				elapsed = _BenchTime() - start;
+			} while (elapsed < 0.1);
+
+			char name[32];
+			snprintf(name, sizeof(name), "%d windows", count);
+			printf("%-16s %-8s %14.2f\n", name, method ? "hash" : "linear", elapsed * 1e9 / lookups);
+			BenchRecord("window lookup", name, method ? "hash" : "linear", "ns/event", elapsed * 1e9 / lookups);
+			if (found != lookups) printf("lookup failed\n");
+		}
+
+		for (int i = 0; i < count; i++) {
+			_WindowMapRemove(&map, (uintptr_t) windows[i]->e.cp);
+			WindowDestroy(windows[i]);
+		}
+
+		free(map.slots);
+		free(windows);
+	}
+}
+
+// Synthetic element trees for the suite: how each element lays out its children, stored in cp.
+#define SUITE_GRID (0) // In a square grid.
+#define SUITE_COLUMN (1) // Stacked vertically.
+#define SUITE_ROW (2) // Side by side.
+
+// Deep trees are made of chains this long, since painting, layout and hit-testing recurse down the tree.
+#define SUITE_CHAIN_DEPTH (256)
+
+int SuiteMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	Rectangle bounds = element->bounds;
+
+	if (message == MSG_PAINT && element->childCount) {
+		DrawBlock((Painter *) dp, RectangleMake(bounds.l, bounds.r, bounds.t, bounds.t + 1), 0x808080);
+	} else if (message == MSG_PAINT) {
+		DrawRectangle((Painter *) dp, bounds, 0xE0E0E0, 0x404040);
+	} else if (message == MSG_LAYOUT) {
+		int layout = (int) (intptr_t) element->cp, count = (int) element->childCount;
+		int columns = layout == SUITE_COLUMN ? 1 : layout == SUITE_ROW ? count : 1;
+		while (layout == SUITE_GRID && columns * columns < count) columns++;
+		int rows = count ? (count + columns - 1) / columns : 1;
+		int64_t width = bounds.r - bounds.l, height = bounds.b - bounds.t;
+
+		for (int i = 0; i < count; i++) {
+			int column = i % columns, row = i / columns;
+			ElementMove(element->children[i], RectangleMake(bounds.l + (int) (column * width / columns), bounds.l + (int) ((column + 1) * width / columns),
+						bounds.t + (int) (row * height / rows), bounds.t + (int) ((row + 1) * height / rows)), false);
+		}
+	}
+
+	return 0;
+}
+
+Element *SuiteCreate(Element *parent, int layout) {
+	Element *element = ElementCreate(sizeof(Element), parent, 0, SuiteMessage);
+	element->cp = (void *) (intptr_t) layout;
+	return element;
+}
+
+// Builds a tree of about count elements under parent, and returns its root.
+Element *SuiteBuild(Element *parent, const char *shape, int count) {
+	Element *root;
+
+	if (0 == strcmp(shape, "wide")) {
+		root = SuiteCreate(parent, SUITE_GRID);
+		for (int i = 1; i < count; i++) SuiteCreate(root, SUITE_GRID);
+	} else if (0 == strcmp(shape, "deep")) {
+		root = SuiteCreate(parent, SUITE_GRID);
+		for (int i = 1; i < count; i += SUITE_CHAIN_DEPTH) {
+			Element *element = root;
+			for (int j = i; j < count && j < i + SUITE_CHAIN_DEPTH; j++) element = SuiteCreate(element, SUITE_GRID);
+		}
+	} else {
+		root = SuiteCreate(parent, SUITE_COLUMN);
+		int rows = 1;
+		while (rows * rows < count) rows++;
+
+		for (int i = 0; i < rows; i++) {
+			Element *row = SuiteCreate(root, SUITE_ROW);
+			for (int j = 0; j < (count - 1 - rows) / rows; j++) SuiteCreate(row, SUITE_GRID);
+		}
+	}
+
+	return root;
+}
+
+size_t SuiteCount(Element *element) {
+	size_t count = 1;
+	for (uintptr_t i = 0; i < element->childCount; i++) count += SuiteCount(element->children[i]);
+	return count;
+}
+
+typedef struct SuiteContext {
+	Window *window;
+	Element *root;
+	Rectangle region;
+	uint32_t random;
+	bool resized;
+} SuiteContext;
+
+void SuiteLayout(SuiteContext *context) {
+	// Alternate between two widths, so that every element moves.
+	context->resized = !context->resized;
+	ElementMove(context->root, RectangleMake(0, context->window->width - context->resized, 0, context->window->height), false);
+	_WindowLayout(context->window);
+}
+
+void SuitePaint(SuiteContext *context) {
+	Painter painter = { 0 };
+	painter.bits = context->window->bits;
+	painter.stride = context->window->stride;
+	painter.height = context->window->height;
+	painter.clip = context->region;
+	_ElementPaint(context->root, &painter);
+}
+
+void SuiteHitTest(SuiteContext *context) {
+	for (int i = 0; i < 64; i++) {
+		context->random = context->random * 1103515245 + 12345;
+		int x = (context->random >> 8) % context->window->width, y = (context->random >> 4) % context->window->height;
+		if (!ElementFindByPoint(context->root, x, y)) printf("hit-test failed\n");
+	}
+}
+
+// Calls run until at least minimum seconds have passed, and returns the average seconds per call.
+double SuiteRepeat(void (*run)(SuiteContext *), SuiteContext *context, double minimum) {
+	uint64_t calls = 0;
+	double start = _BenchTime(), elapsed;
+
+	do {
+		run(context);
+		calls++;
+		elapsed = _BenchTime() - start;
+	} while (elapsed < minimum);
+
+	return elapsed / calls;
+}
+
+void BenchSuite(int maxElements) {
+	const char *shapes[] = { "wide", "deep", "grid" };
+	SuiteContext context = { 0 };
+	context.window = WindowCreate("bench", 3840, 2160);
+	context.random = 1;
+
+	printf("%-16s %9s %10s %10s %10s %10s %10s %10s\n", "suite", "elements", "create ms", "layout ms", "full ms", "part ms", "hit ns", "free ms");
+
+	for (int count = 1000; count <= maxElements; count *= 10) {
+		for (uintptr_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+			double start = _BenchTime();
+			context.root = SuiteBuild(&context.window->e, shapes[i], count);
+			double create = _BenchTime() - start;
+
+			// The first layout places every element; after that, each pass moves them all.
+			ElementMove(context.root, RectangleMake(0, context.window->width, 0, context.window->height), false);
+			_WindowLayout(context.window);
+			double layout = SuiteRepeat(SuiteLayout, &context, 0.1);
+
+			context.region = RectangleMake(0, context.window->width, 0, context.window->height);
+			double paintFull = SuiteRepeat(SuitePaint, &context, 0.1);
+			context.region = RectangleMake(1792, 2048, 952, 1208);
+			double paintPartial = SuiteRepeat(SuitePaint, &context, 0.1);
+			double hitTest = SuiteRepeat(SuiteHitTest, &context, 0.1) / 64;
+
+			size_t elements = SuiteCount(context.root);
+			start = _BenchTime();
+			ElementDestroy(context.root);
+			double destroy = _BenchTime() - start;
+
+			char name[32];
+			snprintf(name, sizeof(name), "%s %d", shapes[i], count);
+			printf("%-16s %9zu %10.2f %10.3f %10.3f %10.3f %10.1f %10.2f\n", name, elements, 
+					create * 1e3, layout * 1e3, paintFull * 1e3, paintPartial * 1e3, hitTest * 1e9, destroy * 1e3);
+			BenchRecord("suite", name, shapes[i], "elements", (double) elements);
+			BenchRecord("suite", name, shapes[i], "create ms", create * 1e3);
+			BenchRecord("suite", name, shapes[i], "layout ms", layout * 1e3);
+			BenchRecord("suite", name, shapes[i], "paint full ms", paintFull * 1e3);
+			BenchRecord("suite", name, shapes[i], "paint 256x256 ms", paintPartial * 1e3);
+			BenchRecord("suite", name, shapes[i], "hit-test ns", hitTest * 1e9);
+			BenchRecord("suite", name, shapes[i], "destroy ms", destroy * 1e3);
+		}
+	}
+
+	WindowDestroy(context.window);
+}
+
+// Pure containers split their bounds in two along the longer side; only the leaves paint.
+int DispatchContainerMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	(void) dp;
+
+	if (message == MSG_LAYOUT && element->childCount == 2) {
+		Rectangle a = element->bounds, b = element->bounds;
+		if (a.r - a.l > a.b - a.t) a.r = b.l = (a.l + a.r) / 2;
+		else a.b = b.t = (a.t + a.b) / 2;
+		ElementMove(element->children[0], a, false);
+		ElementMove(element->children[1], b, false);
+	}
+
+	return 0;
+}
+
+int DispatchLeafMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		// Keep the painting cheap, so that the traversal and dispatch dominate.
+		Rectangle bounds = element->bounds;
+		DrawBlock((Painter *) dp, RectangleMake(bounds.l, bounds.r, bounds.t, bounds.t + 1), (uint32_t) (uintptr_t) element->cp);
+	}
+
+	return 0;
+}
+
+void DispatchBuild(Element *parent, int depth, bool declared) {
+	Element *element = ElementCreate(sizeof(Element), parent, 0, depth ? DispatchContainerMessage : DispatchLeafMessage);
+	element->cp = (void *) (uintptr_t) (depth * 0x101010);
+	if (declared) element->classMessages = MESSAGE_BIT(depth ? MSG_LAYOUT : MSG_PAINT);
+
+	for (int i = 0; depth && i < 2; i++) {
+		DispatchBuild(element, depth - 1, declared);
+	}
+}
+
+// A binary tree of containers, where half of the elements never paint.
+void BenchDispatch(int depth) {
+	printf("%-16s %-8s %10s %10s %10s\n", "dispatch", "messages", "layout ms", "paint ms", "free ms");
+
+	for (int declared = 0; declared < 2; declared++) {
+		// Use a new window each time, so that both trees start with an empty pool.
+		SuiteContext context = { 0 };
+		context.window = WindowCreate("bench", 3840, 2160);
+		context.region = RectangleMake(0, context.window->width, 0, context.window->height);
+		DispatchBuild(&context.window->e, depth, declared);
+		context.root = context.window->e.children[0];
+		ElementMove(context.root, context.region, false);
+		_WindowLayout(context.window);
+		double layout = SuiteRepeat(SuiteLayout, &context, 0.25);
+		double paint = SuiteRepeat(SuitePaint, &context, 0.25);
+		double start = _BenchTime();
+		ElementDestroy(context.root);
+		double destroy = _BenchTime() - start;
+
+		char name[32];
+		snprintf(name, sizeof(name), "binary 2^%d", depth + 1);
+		const char *variant = declared ? "declared" : "all";
+		printf("%-16s %-8s %10.3f %10.3f %10.2f\n", name, variant, layout * 1e3, paint * 1e3, destroy * 1e3);
+		BenchRecord("dispatch", name, variant, "layout ms", layout * 1e3);
+		BenchRecord("dispatch", name, variant, "paint ms", paint * 1e3);
+		BenchRecord("dispatch", name, variant, "destroy ms", destroy * 1e3);
+		WindowDestroy(context.window);
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *jsonPath = NULL;
+	int maxElements = 1000000;
+
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--json") && i + 1 < argc) {
+			jsonPath = argv[++i];
+		} else if (0 == strcmp(argv[i], "--max-elements") && i + 1 < argc) {
+			maxElements = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "Usage: %s [--json results.json] [--max-elements N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	_DrawInitialise();
+	MessageLoopSetFrameInterval(0); // Measure how fast frames can be painted, rather than pacing them like a display.
+	int width = 3840, height = 2160;
+	uint32_t *bits = (uint32_t *) calloc((size_t) width * height, 4);
+	BenchFill(bits, width, height);
+	BenchText(bits, width, height);
+	BenchBlend(bits, width, height);
+	BenchImage(bits, width, height);
+	BenchHeadless(1920, 1080, 1024);
+	BenchOcclusion(1920, 1080, 8, 256);
+	BenchScroll(1920, 1080, 4096);
+	BenchResize(4096);
+	BenchVirtualList(1920, 1080);
+	BenchPresent(1920, 1080, 1024);
+	BenchTimers(1920, 1080, 1024);
+	BenchReplay(1920, 1080, 1024);
+	BenchHitTest(3840, 2160);
+	BenchTree();
+	BenchTraversal(maxElements);
+	BenchParallel(3840, 2160, 4096);
+	BenchWindowLookup();
+	BenchSuite(maxElements);
+	BenchDispatch(16);
+	free(bits);
+
+	if (jsonPath && !BenchWriteJSON(jsonPath)) {
+		fprintf(stderr, "Could not write %s\n", jsonPath);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,444 @@
+// Correctness checks for the drawing kernels and for painting only what has been damaged.
+// Usage: toy_check
+// Prints each failure, and exits with a non-zero status if there were any.
+
+#define TOY_NO_DEMO
+#include "main.c"
+
+#include <stdio.h>
+#include <stdarg.h>
+
+int checkFailures;
+
+void CheckFail(const char *format, ...) {
+	// Stop printing after a few, as one bug usually fails many cases.
+	if (++checkFailures > 20) return;
+	va_list arguments;
+	va_start(arguments, format);
+	printf("FAIL: ");
+	vprintf(format, arguments);
+	printf("\n");
+	va_end(arguments);
+}
+
+uint32_t checkRandomState = 1;
+
+uint32_t CheckRandom() {
+	checkRandomState = checkRandomState * 1664525 + 1013904223;
+	return checkRandomState >> 8;
+}
+
+uint32_t CheckRandomPixel() {
+	return CheckRandom() ^ (CheckRandom() << 16);
+}
+
+// Clamps the colour channels to the alpha, as the blending functions expect premultiplied colours.
+uint32_t CheckPremultiply(uint32_t color) {
+	uint32_t alpha = color >> 24, result = alpha << 24;
+
+	for (int i = 0; i < 24; i += 8) {
+		uint32_t channel = (color >> i) & 0xFF;
+		result |= (channel < alpha ? channel : alpha) << i;
+	}
+
+	return result;
+}
+
+// source + destination * (255 - alpha) / 255 for each channel, rounded to nearest, done the slow way.
+uint32_t CheckBlendReference(uint32_t destination, uint32_t color) {
+	uint32_t inverse = 255 - (color >> 24), result = 0;
+
+	for (int i = 0; i < 32; i += 8) {
+		uint32_t d = (destination >> i) & 0xFF, s = (color >> i) & 0xFF;
+		result |= (s + (d * inverse * 2 + 255) / 510) << i;
+	}
+
+	return result;
+}
+
+bool CheckKernelSupported(const DrawKernel *kernel) {
+	return (kernel->cpuFeatures & _cpuFeatures) == kernel->cpuFeatures;
+}
+
+/////////////////////////////////////////
+// Drawing kernels.
+/////////////////////////////////////////
+
+// Every destination channel against every alpha, through each kernel's blend, in rows wide enough to reach its vector loops.
+void CheckBlendRounding() {
+	uint32_t row[256], expected[256];
+
+	for (uintptr_t k = 0; k < sizeof(_drawKernels) / sizeof(_drawKernels[0]); k++) {
+		const DrawKernel *kernel = &_drawKernels[k];
+		if (!CheckKernelSupported(kernel)) continue;
+
+		for (uint32_t alpha = 0; alpha < 256; alpha++) {
+			uint32_t color = CheckPremultiply(alpha << 24 | (alpha / 2) << 16 | alpha << 8 | alpha / 3);
+
+			for (uint32_t d = 0; d < 256; d++) {
+				row[d] = d * 0x01010101;
+				expected[d] = CheckBlendReference(row[d], color);
+			}
+
+			kernel->blend(row, 256, 256, 1, color);
+
+			for (uint32_t d = 0; d < 256; d++) {
+				if (row[d] != expected[d]) {
+					CheckFail("%s blend of %08x over %08x gave %08x, expected %08x", kernel->name, color, d * 0x01010101, row[d], expected[d]);
+					break;
+				}
+			}
+		}
+	}
+}
+
+#define CHECK_SIZE (64)
+
+// Each vectorised kernel against the scalar one, on random rectangles, glyph masks and image scales.
+void CheckKernels() {
+	static uint32_t expected[CHECK_SIZE * CHECK_SIZE], actual[CHECK_SIZE * CHECK_SIZE];
+	const DrawKernel *scalar = &_drawKernels[0];
+
+	for (uintptr_t k = 1; k < sizeof(_drawKernels) / sizeof(_drawKernels[0]); k++) {
+		const DrawKernel *kernel = &_drawKernels[k];
+		if (!CheckKernelSupported(kernel)) continue;
+
+		for (int i = 0; i < 20000; i++) {
+			for (int j = 0; j < CHECK_SIZE * CHECK_SIZE; j++) expected[j] = actual[j] = CheckRandomPixel();
+			int x = CheckRandom() % 40, y = CheckRandom() % 40, width = CheckRandom() % 24, height = CheckRandom() % 24;
+			uint32_t *a = expected + y * CHECK_SIZE + x, *b = actual + y * CHECK_SIZE + x;
+			uint32_t color = CheckRandomPixel();
+			const char *name;
+
+			if (i % 4 == 0) {
+				bool stream = CheckRandom() & 1;
+				scalar->fill(a, CHECK_SIZE, width, height, color, stream);
+				kernel->fill(b, CHECK_SIZE, width, height, color, stream);
+				name = "fill";
+			} else if (i % 4 == 1) {
+				color = CheckPremultiply(color);
+				scalar->blend(a, CHECK_SIZE, width, height, color);
+				kernel->blend(b, CHECK_SIZE, width, height, color);
+				name = "blend";
+			} else {
+				char string[4];
+				for (int j = 0; j < 4; j++) string[j] = (char) (32 + CheckRandom() % 95);
+				int count = 1 + CheckRandom() % 4, rowStart = CheckRandom() % GLYPH_HEIGHT;
+				int rowEnd = rowStart + CheckRandom() % (GLYPH_HEIGHT + 1 - rowStart);
+				uint8_t firstMask = (uint8_t) (0xFF << (CheckRandom() % 8)), lastMask = (uint8_t) (0xFF >> (CheckRandom() % 8));
+				a = expected + 5 * CHECK_SIZE + x % 20, b = actual + 5 * CHECK_SIZE + x % 20;
+
+				if (i % 4 == 2) {
+					scalar->text(a, CHECK_SIZE, string, count, rowStart, rowEnd, firstMask, lastMask, color);
+					kernel->text(b, CHECK_SIZE, string, count, rowStart, rowEnd, firstMask, lastMask, color);
+					name = "text";
+				} else {
+					color = CheckPremultiply(color);
+					scalar->blendText(a, CHECK_SIZE, string, count, rowStart, rowEnd, firstMask, lastMask, color);
+					kernel->blendText(b, CHECK_SIZE, string, count, rowStart, rowEnd, firstMask, lastMask, color);
+					name = "text blend";
+				}
+			}
+
+			if (memcmp(expected, actual, sizeof(expected))) {
+				CheckFail("%s %s differs from scalar, case %d", kernel->name, name, i);
+			}
+		}
+	}
+
+	// Images go through DrawImage, so the rows are clipped and sampled as they are when painting.
+	Painter painter = { 0 };
+	painter.stride = CHECK_SIZE;
+	painter.height = CHECK_SIZE;
+	uint32_t image[48 * 40];
+
+	for (int i = 0; i < 2000; i++) {
+		int width = 1 + CheckRandom() % 40, height = 1 + CheckRandom() % 32, stride = width + CheckRandom() % 8;
+		for (int j = 0; j < stride * height; j++) image[j] = CheckRandomPixel();
+		Rectangle bounds = RectangleMake((int) (CheckRandom() % 40) - 16, 0, (int) (CheckRandom() % 40) - 16, 0);
+		bounds.r = bounds.l + 1 + CheckRandom() % 80, bounds.b = bounds.t + 1 + CheckRandom() % 80;
+		painter.clip = RectangleMake(CheckRandom() % 16, CHECK_SIZE - CheckRandom() % 16, CheckRandom() % 16, CHECK_SIZE - CheckRandom() % 16);
+		int filter = i & 1 ? IMAGE_BILINEAR : IMAGE_NEAREST;
+
+		for (uintptr_t k = 0; k < sizeof(_drawKernels) / sizeof(_drawKernels[0]); k++) {
+			const DrawKernel *kernel = &_drawKernels[k];
+			if (!CheckKernelSupported(kernel)) continue;
+			_drawImageNearest = kernel->imageNearest;
+			_drawImageBilinear = kernel->imageBilinear;
+			painter.bits = k ? actual : expected;
+			memset(painter.bits, 0, sizeof(expected));
+			DrawImage(&painter, bounds, image, width, height, stride, filter);
+
+			if (k && memcmp(expected, actual, sizeof(expected))) {
+				CheckFail("%s image row (%s) differs from scalar, case %d", kernel->name, filter == IMAGE_BILINEAR ? "bilinear" : "nearest", i);
+			}
+		}
+	}
+
+	_DrawInitialise();
+}
+
+/////////////////////////////////////////
+// Partial repaints.
+/////////////////////////////////////////
+
+int CheckCellMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawRectangle((Painter *) dp, element->bounds, (uint32_t) (uintptr_t) element->cp, 0x404040);
+		DrawString((Painter *) dp, element->bounds, "Cell", 4, 0x000000, true);
+	}
+
+	return 0;
+}
+
+int CheckBackgroundMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawBlock((Painter *) dp, element->bounds, 0xE0E0E0);
+	}
+
+	return 0;
+}
+
+int CheckTranslucentMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		DrawBlockBlend((Painter *) dp, element->bounds, 0x80204080);
+		DrawStringBlend((Painter *) dp, element->bounds, "Over", 4, 0xC0C00000, false);
+	}
+
+	return 0;
+}
+
+int CheckContentMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	(void) dp;
+
+	if (message == MSG_LAYOUT) {
+		for (uint32_t i = 0; i < element->childCount; i++) {
+			int x = element->bounds.l + (i % 10) * 60, y = element->bounds.t + (i / 10) * 30;
+			ElementMove(element->children[i], RectangleMake(x, x + 58, y, y + 28), false);
+		}
+	}
+
+	return 0;
+}
+
+void CheckListRow(VirtualList *list, Painter *painter, Rectangle bounds, uint64_t row) {
+	char label[24];
+	int bytes = snprintf(label, sizeof(label), "Row %d", (int) row);
+	DrawBlock(painter, bounds, row == (uint64_t) list->hoveredRow ? 0xCCE0FF : (row & 1) ? 0xF0F0F0 : 0xFFFFFF);
+	DrawString(painter, bounds, label, bytes, 0x000000, false);
+}
+
+typedef struct CheckTree {
+	Window *window;
+	ScrollPanel *panel;
+	Element *content, *overlay;
+	VirtualList *list;
+} CheckTree;
+
+#define CHECK_WIDTH (640)
+#define CHECK_HEIGHT (480)
+
+CheckTree CheckTreeCreate() {
+	CheckTree tree;
+	tree.window = WindowCreate("check", CHECK_WIDTH, CHECK_HEIGHT);
+	Element *root = ElementCreate(sizeof(Element), &tree.window->e, 0, CheckBackgroundMessage);
+	tree.panel = ScrollPanelCreate(root, 0, 0xFFFFFF);
+	tree.content = ElementCreate(sizeof(Element), &tree.panel->e, 0, CheckContentMessage);
+
+	for (int i = 0; i < 500; i++) {
+		ElementCreate(sizeof(Element), tree.content, 0, CheckCellMessage)->cp = (void *) (uintptr_t) (i * 0x10305 & 0xFFFFFF);
+	}
+
+	ScrollPanelSetContentSize(tree.panel, 650, 1500);
+	tree.list = VirtualListCreate(root, 0, 20, CheckListRow, 0xFFFFFF);
+	VirtualListSetRowCount(tree.list, 100000);
+	tree.overlay = ElementCreate(sizeof(Element), root, 0, CheckTranslucentMessage);
+	ElementMove(root, RectangleMake(0, CHECK_WIDTH, 0, CHECK_HEIGHT), false);
+	ElementMove(&tree.panel->e, RectangleMake(20, 420, 30, 370), false);
+	ElementMove(&tree.list->e, RectangleMake(440, 620, 30, 460), false);
+	ElementMove(tree.overlay, RectangleMake(430, 490, 0, 40), false);
+	ElementRelayout(&tree.window->e);
+	return tree;
+}
+
+// Applies the same random changes to a window painted incrementally, and to one repainted in full every frame.
+// After every frame, the two must match pixel for pixel.
+void CheckRepaint(int threadCount) {
+	ParallelPaintEnable(threadCount);
+	CheckTree a = CheckTreeCreate(), b = CheckTreeCreate();
+	checkRandomState = 1;
+
+	for (int frame = 0; frame < 1500; frame++) {
+		for (int operations = 1 + CheckRandom() % 3; operations; operations--) {
+			int operation = CheckRandom() % 12;
+
+			if (operation < 5) {
+				int x = a.panel->scrollX + (int) (CheckRandom() % 41) - 20;
+				int y = a.panel->scrollY + (CheckRandom() % 2 ? (int) (CheckRandom() % 101) - 50 : (int) (CheckRandom() % 801) - 400);
+				ScrollPanelScrollTo(a.panel, x, y);
+				ScrollPanelScrollTo(b.panel, x, y);
+			} else if (operation < 7) {
+				uint64_t scroll = a.list->scroll + CheckRandom() % 200;
+				if (CheckRandom() & 1) scroll = scroll > 300 ? scroll - 300 : 0;
+				VirtualListScrollTo(a.list, scroll);
+				VirtualListScrollTo(b.list, scroll);
+			} else if (operation < 9) {
+				uint32_t i = CheckRandom() % 500;
+				void *color = (void *) (uintptr_t) (CheckRandom() & 0xFFFFFF);
+				a.content->children[i]->cp = b.content->children[i]->cp = color;
+				ElementRepaint(a.content->children[i], NULL);
+				ElementRepaint(b.content->children[i], NULL);
+			} else if (operation < 10) {
+				// Move the overlay, sometimes over the panel or the list.
+				int x = CheckRandom() % (CHECK_WIDTH - 50), y = CheckRandom() % (CHECK_HEIGHT - 40);
+				Rectangle old = a.overlay->bounds;
+				ElementMove(a.overlay, RectangleMake(x, x + 50, y, y + 40), false);
+				ElementMove(b.overlay, RectangleMake(x, x + 50, y, y + 40), false);
+				ElementRepaint(&a.window->e, &old);
+				ElementRepaint(a.overlay, NULL);
+			} else if (operation < 11) {
+				a.window->cursorX = b.window->cursorX = CheckRandom() % CHECK_WIDTH;
+				a.window->cursorY = b.window->cursorY = CheckRandom() % CHECK_HEIGHT;
+				_WindowInputEvent(a.window, MSG_MOUSE_MOVE, 0, 0);
+				_WindowInputEvent(b.window, MSG_MOUSE_MOVE, 0, 0);
+			} else {
+				a.panel->e.flags ^= ELEMENT_LAYER_CACHE;
+				b.panel->e.flags ^= ELEMENT_LAYER_CACHE;
+			}
+		}
+
+		ElementRepaint(&b.window->e, NULL);
+		_Update();
+
+		for (int y = 0; y < CHECK_HEIGHT; y++) {
+			if (memcmp(a.window->bits + y * a.window->stride, b.window->bits + y * b.window->stride, CHECK_WIDTH * 4)) {
+				CheckFail("%d threads: frame %d differs from a full repaint on row %d", threadCount, frame, y);
+				frame = 1500;
+				break;
+			}
+		}
+	}
+
+	WindowDestroy(a.window);
+	WindowDestroy(b.window);
+	ParallelPaintEnable(0);
+}
+
+int CheckAnchoredMessage(Element *element, Message message, int di, void *dp) {
+	(void) element;
+	(void) di;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter *) dp;
+
+		for (int y = painter->clip.t; y < painter->clip.b; y++) {
+			for (int x = painter->clip.l; x < painter->clip.r; x++) {
+				painter->bits[y * painter->stride + x] = x * 7919 ^ y * 104729;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// With ELEMENT_RESIZE_KEEPS_PIXELS, only the exposed strips are painted, so whatever was kept must still be right.
+void CheckResize() {
+	Window *window = WindowCreate("check", 300, 200);
+	ElementCreate(sizeof(Element), &window->e, ELEMENT_RESIZE_KEEPS_PIXELS | ELEMENT_OPAQUE, CheckAnchoredMessage);
+	ElementRelayout(&window->e);
+	_Update();
+
+	for (int i = 0; i < 2000; i++) {
+		int width = 1 + CheckRandom() % 900, height = 1 + CheckRandom() % 700;
+
+		if (i % 3 == 0) {
+			// Small steps, like a live resize.
+			width = window->width + (int) (CheckRandom() % 9) - 4, height = window->height + (int) (CheckRandom() % 9) - 4;
+			if (width < 1) width = 1;
+			if (height < 1) height = 1;
+		}
+
+		// Sometimes shrink first, like ConfigureNotify events arriving faster than frames are painted.
+		if (i % 5 == 1) _WindowResize(window, 1 + width / 2, 1 + height / 2);
+		_WindowResize(window, width, height);
+		_Update();
+
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				if (window->bits[y * window->stride + x] != (uint32_t) (x * 7919 ^ y * 104729)) {
+					CheckFail("resize %d to %dx%d left pixel %d,%d stale", i, width, height, x, y);
+					y = height;
+					break;
+				}
+			}
+		}
+	}
+
+	WindowDestroy(window);
+}
+
+// Recordings refer to windows by creation order, so events reach the same windows however many there are,
+// and after others have been destroyed.
+void CheckInputRecording() {
+	Window *windows[300];
+	for (int i = 0; i < 300; i++) windows[i] = WindowCreate("check", 50, 50);
+	FILE *file = tmpfile();
+	InputRecordStart(file);
+
+	for (int i = 299; i >= 0; i -= 37) {
+		if (i == 40) {
+			WindowDestroy(windows[4]);
+			windows[4] = NULL;
+		}
+
+		windows[i]->cursorX = i;
+		windows[i]->cursorY = i + 1;
+		_WindowInputEvent(windows[i], MSG_MOUSE_MOVE, 0, 0);
+	}
+
+	InputRecordStop();
+	for (int i = 0; i < 300; i++) if (windows[i]) windows[i]->cursorX = windows[i]->cursorY = -1;
+	rewind(file);
+	InputReplayReport report;
+
+	if (!InputReplay(file, false, &report) || report.events != 9 || report.skipped) {
+		CheckFail("replay handled %d events and skipped %d", (int) report.events, (int) report.skipped);
+	}
+
+	for (int i = 0; i < 300; i++) {
+		int expected = (299 - i) % 37 ? -1 : i;
+
+		if (windows[i] && (windows[i]->cursorX != expected || windows[i]->cursorY != (expected < 0 ? -1 : i + 1))) {
+			CheckFail("replay moved window %d's cursor to %d,%d", i, windows[i]->cursorX, windows[i]->cursorY);
+		}
+
+		if (windows[i]) WindowDestroy(windows[i]);
+	}
+
+	fclose(file);
+}
+
+int main() {
+	Initialise();
+	CheckBlendRounding();
+	CheckKernels();
+	CheckRepaint(0);
+	CheckRepaint(4);
+	CheckResize();
+	CheckInputRecording();
+
+	if (checkFailures) {
+		printf("%d checks failed\n", checkFailures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
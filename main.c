@@ -5,11 +5,29 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ARCH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(features) __attribute__((target(features)))
+#else
+#define TARGET(features)
+#endif
 
 #ifdef PLATFORM_WIN32
 #define Rectangle W32Rectangle
 #include <windows.h>
 #undef Rectangle
+#else
+#include <pthread.h>
+#include <time.h>
 #endif
 
 #ifdef PLATFORM_LINUX
@@ -18,6 +36,16 @@
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef USE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 #undef Window
 #endif
 
@@ -27,45 +55,209 @@
 
 #define UPDATE_HOVERED (1)
 
+#define ELEMENT_SPATIAL_INDEX (1 << 16) // Hit-test the children through a uniform grid.
+#define ELEMENT_LAYER_CACHE (1 << 17) // Keep the painted subtree in an offscreen layer. The element must paint every pixel of its bounds.
+#define ELEMENT_OPAQUE (1 << 18) // The element paints every pixel of its bounds, so whatever is beneath it needn't be painted.
+#define ELEMENT_HAS_TIMERS (1 << 19) // Set by ElementStartTimer, so only elements with timers need to be looked for when freed.
+#define ELEMENT_RESIZE_KEEPS_PIXELS (1 << 20) // On a window's first child: resizing the window leaves its pixels correct, so only newly exposed strips are painted.
+#define ELEMENT_NEEDS_LAYOUT (1U << 29) // MSG_LAYOUT will be sent by the next layout pass.
+#define ELEMENT_DESCENDANT_NEEDS_LAYOUT (1U << 30)
+#define ELEMENT_POOLED (1U << 31) // Set by ElementCreate if the element was allocated from its window's pool.
+
 typedef enum Message {
 	MSG_PAINT, // dp = pointer to Painter
 	MSG_LAYOUT,
 	MSG_UPDATE, // di = UPDATE_... constant
 	MSG_MOUSE_MOVE,
+	MSG_DESTROY, // Sent to each element in a subtree before it is freed.
+	MSG_TIMER, // di = id returned by ElementStartTimer
 	MSG_USER,
 } Message;
 
+// Elements declare which messages each of their handlers wants with these bits; the others aren't dispatched.
+// All user messages share the last bit, so adding system messages doesn't change which bit they use.
+#define MESSAGE_BIT(message) (1U << ((message) < MSG_USER ? (message) : 31))
+#define MESSAGE_MASK_ALL (0xFFFFFFFF)
+
 typedef struct Rectangle {
 	int l, r, t, b;
 } Rectangle;
 
+#define DAMAGE_MAX_RECTANGLES (16)
+#define FRAMEBUFFER_SLACK (4) // Framebuffers are allocated a quarter bigger than needed in each direction, and shrunk once less than a quarter is used.
+
+// A set of disjoint rectangles that need to be repainted.
+typedef struct DamageRegion {
+	Rectangle rectangles[DAMAGE_MAX_RECTANGLES];
+	int count;
+} DamageRegion;
+
 typedef struct Painter {
 	Rectangle clip;
 	uint32_t *bits;
-	int width, height;
+	int stride, height; // The stride is the number of pixels from the start of one row to the next.
+	uint64_t pixelsDrawn; // Total area of the clips MSG_PAINT was sent with, for the overdraw statistic.
 } Painter;
 
+#ifdef PLATFORM_WIN32
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Condition;
+typedef HANDLE Thread;
+#define THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID argument)
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+typedef pthread_t Thread;
+#define THREAD_FUNCTION(name) void *name(void *argument)
+#endif
+
+#define PARALLEL_MAX_THREADS (64)
+#define PARALLEL_MINIMUM_PIXELS (256 * 256) // Smaller updates aren't worth waking the workers for.
+
+typedef struct PaintWorker {
+	// The tiles [next, end) still to be painted by this worker, packed as end << 32 | next.
+	// The worker takes tiles from the front, and other workers steal from the back.
+	volatile uint64_t range; 
+	Thread thread;
+} PaintWorker;
+
+typedef struct ParallelPaint {
+	int threadCount; // Including the thread calling _Update. 0 if disabled.
+	PaintWorker workers[PARALLEL_MAX_THREADS];
+	struct Window *window;
+	Rectangle *tiles;
+	size_t tileCount, tileCapacity;
+	Mutex mutex;
+	Condition start, done;
+	uint64_t generation; // Incremented to start the workers on a new set of tiles.
+	int running; // Workers that haven't finished the current set.
+	bool quit;
+	bool painting; // Set while the workers paint; layers are then read-only.
+	volatile uint64_t pixelsDrawn; // Summed from each worker's painter.
+} ParallelPaint;
+
+#define PRESENT_MAX_BUFFERS (3) // Including the window's own bits.
+
+// A copy of the damaged pixels of a finished frame, waiting for the present thread.
+// Only the pixels inside region are valid.
+typedef struct PresentBuffer {
+	struct Window *window;
+	uint32_t *bits;
+	size_t capacity; // In pixels.
+	int width, height, stride; // Of the window when the frame was painted.
+	DamageRegion region;
+	uint64_t inputTime; // Copied from the window.
+	bool busy; // Queued or being presented.
+#ifdef USE_XSHM
+	XImage *image; // The shared memory image around bits, or NULL if they're plain memory.
+	XShmSegmentInfo shmInfo;
+#endif
+} PresentBuffer;
+
+typedef struct PresentThread {
+	int bufferCount; // Including the windows' own bits. 0 if presenting from _Update.
+	PresentBuffer buffers[PRESENT_MAX_BUFFERS - 1];
+	PresentBuffer *queue[PRESENT_MAX_BUFFERS - 1]; // Presented in order.
+	int queueStart, queueCount;
+	Mutex mutex;
+	Condition queued, presented;
+	Thread thread;
+	bool initialised, quit;
+} PresentThread;
+
 struct Element;
 typedef int (*MessageHandler)(struct Element *element, Message message, int di, void *dp);
 
+typedef struct SpatialCell {
+	uint32_t *children; // Indices of the children whose clip overlaps the cell, in ascending order.
+	uint32_t count, capacity;
+} SpatialCell;
+
+typedef struct SpatialGrid {
+	Rectangle area; // The parent's clip when the grid was built.
+	int columns, rows, cellWidth, cellHeight;
+	SpatialCell *cells;
+	bool dirty; // Rebuilt on the next query.
+} SpatialGrid;
+
+// The pixels of a subtree with ELEMENT_LAYER_CACHE, covering its clip.
+typedef struct Layer {
+	struct Element *element;
+	uint32_t *bits;
+	Rectangle rectangle; // The element's clip when the layer was allocated.
+	Rectangle dirty; // Needs painting again before the next blit; invalid if the layer is up to date.
+	bool busy; // Can't be evicted while it is being painted or blitted.
+	struct Layer *previous, *next; // Most recently used first.
+} Layer;
+
+#define LAYER_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+typedef struct LayerCache {
+	Layer *first, *last;
+	size_t bytes;
+	size_t budget; // 0 means LAYER_CACHE_DEFAULT_BUDGET.
+} LayerCache;
+
+// Elements are allocated in size classes from slabs owned by their window.
+// This keeps siblings close together in memory, and makes freeing cheap.
+
+#define POOL_SLAB_BYTES (64 * 1024)
+#define POOL_GRANULARITY (16)
+#define POOL_CLASSES (32) // Elements up to POOL_CLASSES * POOL_GRANULARITY bytes use the pool.
+
+typedef struct PoolSlab {
+	struct PoolSlab *next;
+	size_t used; // Including this header.
+} PoolSlab;
+
+typedef struct ElementPool {
+	void *freeLists[POOL_CLASSES];
+	PoolSlab *slabs; // The first slab is the one being carved up.
+} ElementPool;
+
+// The clips of an element's children, kept by the parent as four arrays of edges with childCapacity entries each.
+// Traversals test these before touching a child, and hit tests compare several children at once.
+// Entries past childCount are zeroed, so they never contain a point or intersect a rectangle.
+#define CHILD_CLIP_L(element, i) ((element)->childClips[i])
+#define CHILD_CLIP_R(element, i) ((element)->childClips[(element)->childCapacity + (i)])
+#define CHILD_CLIP_T(element, i) ((element)->childClips[(element)->childCapacity * 2 + (i)])
+#define CHILD_CLIP_B(element, i) ((element)->childClips[(element)->childCapacity * 3 + (i)])
+
 typedef struct Element {
+	// Fields read while painting and hit testing come first, so they share as few cache lines as possible.
 	uint32_t flags; // First 16 bits are element specific.
 	uint32_t childCount;
-	Rectangle bounds, clip;
-	struct Element *parent;
+	Rectangle clip;
 	struct Element **children;
+	int *childClips; // See CHILD_CLIP_L.
+	MessageHandler messageClass;
+	uint32_t classMessages, userMessages; // MESSAGE_BIT masks; ElementCreate sets both to MESSAGE_MASK_ALL.
+	Layer *layer; // Created on demand if ELEMENT_LAYER_CACHE is set; may be evicted at any time.
+
+	uint32_t childCapacity; // Always a multiple of 4.
+	uint32_t index; // Position in parent->children.
+	Rectangle bounds;
+	uint32_t bytes; // Size passed to ElementCreate.
+	struct Element *parent;
 	struct Window *window;
 	void *cp; // Context pointer (for user).
-	MessageHandler messageClass, messageUser;
+	MessageHandler messageUser;
+	SpatialGrid *grid; // Created on demand if ELEMENT_SPATIAL_INDEX is set.
 } Element;
 
 typedef struct Window {
 	Element e;
+	ElementPool pool;
 	uint32_t *bits;
 	int width, height;
+	int stride; // Pixels from one row of bits to the next; the rows have slack, so that resizing rarely reallocates.
+	size_t capacity; // Pixels allocated for bits, including the slack.
+	int laidOutWidth, laidOutHeight; // The size at the last layout, to work out which strips a resize exposed.
 	Element *hovered;
 	int cursorX, cursorY;
-	Rectangle updateRegion;
+	DamageRegion updateRegion;
+	uint64_t inputTime; // When the first input event since the last frame arrived, in microseconds; 0 if none.
+	uint64_t ordinal; // How many windows were created before this one; unlike its index in global.windows, it never changes.
 
 #ifdef PLATFORM_WIN32
 	HWND hwnd;
@@ -75,30 +267,248 @@ typedef struct Window {
 #ifdef PLATFORM_LINUX
 	X11Window window;
 	XImage *image;
+	DamageRegion exposed; // From the Expose events of a batch, until the last one arrives.
+#ifdef USE_XSHM
+	XShmSegmentInfo shmInfo;
+	bool shm; // The image lives in a shared memory segment attached to the X server.
+	int shmPending; // Outstanding XShmPutImage requests; the server may still be reading bits.
+#endif
 #endif
 } Window;
 
+// Shows part of its first child, which is laid out at the content size and moved to scroll.
+// Scrolling moves the pixels already in the window, so only the newly exposed strips are painted.
+typedef struct ScrollPanel {
+	Element e;
+	int contentWidth, contentHeight;
+	int scrollX, scrollY; // Clamped so the content covers the panel where it can.
+	uint32_t background; // Painted wherever the content doesn't reach.
+} ScrollPanel;
+
+struct VirtualList;
+
+// Paints one row of a VirtualList; it must cover every pixel of the row's bounds.
+typedef void (*VirtualListPaintRow)(struct VirtualList *list, Painter *painter, Rectangle bounds, uint64_t row);
+
+// A list of fixed-height rows that aren't elements; only the rows in the clip are painted, directly by paintRow.
+typedef struct VirtualList {
+	Element e;
+	uint64_t rowCount;
+	int rowHeight;
+	uint64_t scroll; // Pixels between the top of the first row and the top of the list.
+	int64_t hoveredRow; // -1 if the cursor isn't over a row.
+	VirtualListPaintRow paintRow;
+	uint32_t background; // Painted below the last row.
+} VirtualList;
+
+// Shows a bitmap scaled to its bounds.
+// The scaled pixels are kept, and only scaled again in MSG_LAYOUT when the size changes, so painting, including in parallel, just copies rows.
+typedef struct ImageDisplay {
+	Element e;
+	const uint32_t *bits; // Owned by the caller.
+	int width, height, stride;
+	int filter;
+	uint32_t *scaled; // NULL if the bitmap is shown at its own size, or is too big to keep a scaled copy.
+	int scaledWidth, scaledHeight;
+} ImageDisplay;
+
+#define IMAGE_DISPLAY_MAX_SCALED_PIXELS (16 * 1024 * 1024) // Bigger displays scale the visible part each time they are painted.
+
+typedef struct Statistics {
+	uint64_t frames; // Calls to _Update that painted something.
+	uint64_t pixelsPainted; // Total area of the damage rectangles painted in the last frame.
+	uint64_t pixelsPaintedTotal;
+	uint64_t pixelsDrawn; // Total area of the clips MSG_PAINT was sent with in the last frame; divide by pixelsPainted for the overdraw.
+	uint64_t eventsCoalesced; // Input and configure events skipped because a newer one superseded them.
+	uint64_t layerHits, layerMisses; // Layer blits that could reuse the cached pixels, and ones that had to paint first.
+	uint64_t layoutPasses; // Batched layout passes that found work to do.
+	uint64_t layoutMessages; // MSG_LAYOUT sent since the start of the last frame.
+	uint64_t pixelsScrolled; // Total area moved by blit-scrolling rather than painted again.
+	uint64_t inputLatency; // Microseconds from the input handled for the last presented frame until it was presented.
+	uint64_t inputLatencyTotal, inputLatencyFrames;
+	uint64_t timersFired;
+} Statistics;
+
+typedef struct Timer {
+	Element *element;
+	uint64_t deadline; // Microseconds, from _TimeMicroseconds.
+	uint64_t interval; // 0 for a timer that only fires once.
+	uint32_t id;
+} Timer;
+
+// A message sent to an element from another thread with ElementPostMessage.
+typedef struct PostedMessage {
+	Element *element;
+	Message message;
+	int di;
+	void *dp;
+} PostedMessage;
+
+// Input is recorded as a sequence of events after INPUT_RECORD_MAGIC.
+// Each event is a type byte, the window, the microseconds since the previous event, and two arguments.
+// The window is its ordinal, counted from the oldest window that was open when recording started.
+// The numbers are written 7 bits to a byte, with the arguments zigzag encoded since they can be negative.
+#define INPUT_RECORD_MAGIC "TOYINPT2"
+#define INPUT_RECORD_MOVE (1) // The cursor position, or -1, -1 once it leaves the window.
+#define INPUT_RECORD_RESIZE (2) // The new width and height.
+#define INPUT_RECORD_EXPOSE (3) // No arguments; some of the window's pixels were lost and need presenting again. Replayed as the whole window.
+
+typedef struct InputRecorder {
+	FILE *file; // NULL if not recording.
+	uint64_t lastTime;
+	uint64_t arrivalTime; // When MessageLoop dequeued the platform event being handled, in microseconds; 0 outside of its dispatch.
+	uint64_t firstOrdinal; // Of the oldest window open when recording started.
+	bool replaying; // The events come from InputReplay, so they aren't recorded again.
+	uint64_t *latencies; // Microseconds, for each frame presented during a replay.
+	size_t latencyCount, latencyCapacity;
+} InputRecorder;
+
+typedef struct InputReplayReport {
+	uint64_t events, frames;
+	uint64_t skipped; // Events for windows that weren't open during the replay.
+	uint64_t latencyP50, latencyP90, latencyP99, latencyMax; // Microseconds from an event's arrival to presenting the frame it caused.
+	double seconds;
+} InputReplayReport;
+
+// Maps a platform window handle to its Window, using open addressing with linear probing.
+typedef struct WindowMapSlot {
+	uintptr_t handle; // 0 if the slot is empty.
+	Window *window;
+} WindowMapSlot;
+
+typedef struct WindowMap {
+	WindowMapSlot *slots;
+	size_t capacity, count; // The capacity is a power of 2.
+} WindowMap;
+
 typedef struct GlobalState {
 	Window **windows;
-	size_t windowCount;
+	size_t windowCount, windowCapacity;
+	WindowMap windowMap;
+	WindowMap windowOrdinals; // Keyed by ordinal + 1, as 0 marks an empty slot.
+	uint64_t windowsCreated;
+	Statistics stats;
+	ParallelPaint parallel;
+	LayerCache layers;
+	PresentThread present;
+	bool layingOut; // Inside a layout pass, where ElementMove lays out immediately.
+
+	uint64_t frameInterval; // Minimum microseconds between calls to _Update from MessageLoop.
+	Timer *timers; // A binary heap, ordered by deadline.
+	size_t timerCount, timerCapacity;
+	uint32_t nextTimerID;
+
+	Mutex postedMutex;
+	PostedMessage *posted;
+	size_t postedCapacity;
+	volatile uint64_t postedCount; // Read without the mutex to skip locking it when nothing has been posted.
+	PostedMessage *dispatching; // The messages being sent by the message loop.
+	size_t dispatchingCount;
+
+	InputRecorder input;
+
+#ifdef PLATFORM_WIN32
+	DWORD threadID; // Woken by ElementPostMessage.
+#endif
 
 #ifdef PLATFORM_LINUX
 	Display *display;
 	Visual *visual;
 	Atom windowClosedID;
+	int epollFD, timerFD, wakeFD; // MessageLoop waits on the connection, the next deadline, and ElementPostMessage.
+#ifdef USE_XSHM
+	bool shmAvailable;
+	int shmCompletionEvent;
+#endif
+#endif
+
+#ifdef PLATFORM_HEADLESS
+	bool (*frameHandler)(uint64_t frame); // Called before each frame; return false to exit MessageLoop.
+	void (*presentHandler)(Window *window, const uint32_t *bits, int stride, DamageRegion *region); // Called with each frame as it is presented.
+	uint64_t frameCount;
 #endif
 } GlobalState;
 
+#ifdef TOY_TRACE
+
+// Instrumentation, compiled in by defining TOY_TRACE.
+// Timed regions are recorded into a ring buffer that keeps the most recent TRACE_BUFFER_EVENTS events.
+
+#define TRACE_BUFFER_EVENTS (1 << 16) // Must be a power of 2.
+#define TRACE_FRAME_HISTORY (256) // Frames covered by the rolling histogram.
+#define TRACE_HISTOGRAM_BUCKETS (34) // 0.5 ms each; the last bucket holds everything slower.
+
+typedef struct TraceEvent {
+	const char *name;
+	const void *element;
+	uint64_t start, duration; // Nanoseconds.
+	uint64_t thread;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+	volatile uint64_t written; // Total events recorded; the next one goes in events[written % TRACE_BUFFER_EVENTS].
+	uint32_t frameTimes[TRACE_FRAME_HISTORY]; // Microseconds.
+	uint32_t histogram[TRACE_HISTOGRAM_BUCKETS];
+	uint64_t frames;
+} TraceBuffer;
+
+// Call these between frames, when no other thread is painting.
+bool TraceWriteJSON(FILE *file); // Chrome trace-event format, for chrome://tracing or Perfetto.
+void TraceWriteHistogram(FILE *file);
+
+#define TRACE_BEGIN() uint64_t _traceStart = _TraceTime()
+#define TRACE_END(name, element) _TraceRecord(name, element, _traceStart)
+#else
+#define TRACE_BEGIN()
+#define TRACE_END(name, element)
+#endif
+
 void Initialise();
 int MessageLoop();
+void MessageLoopSetFrameInterval(uint64_t microseconds); // Call after Initialise. Defaults to 1/60 s on X11 and 0 headless; Win32 paints as its messages arrive.
 
 Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass);
+void ElementDestroy(Element *element); // Frees the element and all its descendants.
 void ElementRepaint(Element *element, Rectangle *region);
+void ElementRelayout(Element *element); // Sends MSG_LAYOUT in the next layout pass, before painting.
 void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout);
 int ElementMessage(Element *element, Message message, int di, void *dp);
+void ElementPostMessage(Element *element, Message message, int di, void *dp); // Can be called from any thread; the message is sent by MessageLoop.
+uint32_t ElementStartTimer(Element *element, uint32_t milliseconds, bool repeat); // Sends MSG_TIMER from MessageLoop once the time has passed.
+void ElementStopTimer(Element *element, uint32_t id);
 Element *ElementFindByPoint(Element *element, int x, int y);
 
 Window *WindowCreate(const char *cTitle, int width, int height);
+void WindowDestroy(Window *window);
+
+void ParallelPaintEnable(int threadCount); // Pass 0 or 1 to paint on the calling thread only.
+void PresentThreadEnable(int bufferCount); // Pass 2 or 3 to present from a separate thread, or 0 or 1 to present from _Update.
+void LayerCacheSetBudget(size_t bytes); // Evicts least recently used layers until they fit.
+
+bool InputRecordStart(FILE *file); // Writes the input events handled from now on to the file, until InputRecordStop.
+void InputRecordStop();
+// Feeds a recording back through the same paths as the platform's events, painting as MessageLoop would.
+// The windows must be created in the same order as when it was recorded. With realTime, the original timing is kept; otherwise, each event is painted as soon as possible.
+bool InputReplay(FILE *file, bool realTime, InputReplayReport *report);
+
+ScrollPanel *ScrollPanelCreate(Element *parent, uint32_t flags, uint32_t background);
+void ScrollPanelSetContentSize(ScrollPanel *panel, int width, int height);
+void ScrollPanelScrollTo(ScrollPanel *panel, int x, int y);
+
+VirtualList *VirtualListCreate(Element *parent, uint32_t flags, int rowHeight, VirtualListPaintRow paintRow, uint32_t background); // rowHeight is at least 1.
+void VirtualListSetRowCount(VirtualList *list, uint64_t rowCount);
+void VirtualListScrollTo(VirtualList *list, uint64_t scroll); // Clamped so the rows fill the list where they can.
+void VirtualListRepaintRow(VirtualList *list, uint64_t row);
+int64_t VirtualListRowAt(VirtualList *list, int x, int y); // -1 if there's no row at the point.
+
+ImageDisplay *ImageDisplayCreate(Element *parent, uint32_t flags, int filter);
+void ImageDisplaySetImage(ImageDisplay *display, const uint32_t *bits, int width, int height, int stride); // The bits must stay valid while shown.
+
+#ifdef PLATFORM_HEADLESS
+void WindowResize(Window *window, int width, int height);
+bool WindowWriteFrame(Window *window, FILE *file); // Raw 32-bit BGRX pixels, top row first.
+#endif
 
 Rectangle RectangleMake(int l, int r, int t, int b);
 Rectangle RectangleIntersection(Rectangle a, Rectangle b);
@@ -106,12 +516,57 @@ Rectangle RectangleBounding(Rectangle a, Rectangle b);
 bool RectangleValid(Rectangle a);
 bool RectangleEquals(Rectangle a, Rectangle b);
 bool RectangleContains(Rectangle a, int x, int y);
+void DamageAdd(DamageRegion *region, Rectangle r);
 void StringCopy(char **destination, size_t *destinationBytes, const char *source, ptrdiff_t sourceBytes);
 
 void DrawString(Painter *painter, Rectangle r, const char *string, size_t bytes, uint32_t color, bool centerAlign);
 void DrawRectangle(Painter *painter, Rectangle r, uint32_t fill, uint32_t outline);
 void DrawBlock(Painter *painter, Rectangle r, uint32_t fill);
 
+// Blended variants, taking premultiplied 0xAARRGGBB colors: no color channel may be greater than the alpha.
+void DrawStringBlend(Painter *painter, Rectangle r, const char *string, size_t bytes, uint32_t color, bool centerAlign);
+void DrawRectangleBlend(Painter *painter, Rectangle r, uint32_t fill, uint32_t outline);
+void DrawBlockBlend(Painter *painter, Rectangle r, uint32_t fill);
+
+// Copies a bitmap of 0xAARRGGBB pixels, stride pixels apart, scaled to fill r.
+#define IMAGE_NEAREST (0)
+#define IMAGE_BILINEAR (1)
+void DrawImage(Painter *painter, Rectangle r, const uint32_t *bits, int width, int height, int stride, int filter);
+
+#define CPU_SSE2 (1 << 0)
+#define CPU_AVX2 (1 << 1)
+#define CPU_AVX512 (1 << 2)
+
+// Fills height rows of width pixels, starting at bits and separated by stride pixels.
+// If stream is set, the kernel may bypass the cache with non-temporal stores.
+typedef void (*FillFunction)(uint32_t *bits, int stride, int width, int height, uint32_t color, bool stream);
+
+// Like FillFunction, but blends the premultiplied color over the pixels.
+typedef void (*BlendFunction)(uint32_t *bits, int stride, int width, int height, uint32_t color);
+
+// Draws count glyphs from string, GLYPH_WIDTH pixels apart, starting at bits.
+// Only glyph rows [rowStart, rowEnd) are drawn, and bits points at rowStart of the first glyph.
+// The columns of the first and last glyph are masked by firstMask and lastMask.
+typedef void (*TextFunction)(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color);
+
+// Draws width pixels at row from the source rows top and bottom, which are interpolated by bottomWeight out of 256.
+// Pixel x comes from source column columns[x]; for bilinear filtering, it is interpolated with the next column,
+// with 256 minus that column's weight in the low 16 bits of weights[x], and the weight in the high 16 bits.
+// Nearest filtering only reads top and columns. scratch has room for a source row.
+typedef void (*ImageRowFunction)(uint32_t *row, int width, const uint32_t *top, const uint32_t *bottom, int bottomWeight, 
+		const int32_t *columns, const uint32_t *weights, uint32_t *scratch);
+
+typedef struct DrawKernel {
+	const char *name;
+	FillFunction fill;
+	TextFunction text;
+	BlendFunction blend;
+	TextFunction blendText;
+	ImageRowFunction imageNearest, imageBilinear;
+	uint32_t cpuFeatures; // CPU_... flags required.
+} DrawKernel;
+
 /////////////////////////////////////////
 // Helper functions.
 /////////////////////////////////////////
@@ -146,6 +601,19 @@ bool RectangleEquals(Rectangle a, Rectangle b) {
 	return a.l == b.l && a.r == b.r && a.t == b.t && a.b == b.b;
 }
 
+// Returns the part of a not covered by b, if that is a rectangle, or else a.
+Rectangle _RectangleSubtract(Rectangle a, Rectangle b) {
+	if (b.l <= a.l && b.r >= a.r) {
+		if (b.t <= a.t && b.b > a.t) a.t = b.b;
+		else if (b.b >= a.b && b.t < a.b) a.b = b.t;
+	} else if (b.t <= a.t && b.b >= a.b) {
+		if (b.l <= a.l && b.r > a.l) a.l = b.r;
+		else if (b.r >= a.r && b.l < a.r) a.r = b.l;
+	}
+
+	return a;
+}
+
 bool RectangleContains(Rectangle a, int x, int y) {
 	return a.l <= x && a.r > x && a.t <= y && a.b > y;
 }
@@ -157,6 +625,209 @@ void StringCopy(char **destination, size_t *destinationBytes, const char *source
 	memcpy(*destination, source, sourceBytes);
 }
 
+// Merging two damage rectangles into their bounding rectangle is worth it if it paints few extra pixels,
+// since each rectangle costs a traversal of the element tree and an upload.
+#define DAMAGE_MERGE_PIXELS (64 * 64)
+
+uint64_t _TimeMicroseconds() {
+#ifdef PLATFORM_WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t) (counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#endif
+}
+
+void _SleepMicroseconds(uint64_t microseconds) {
+#ifdef PLATFORM_WIN32
+	Sleep((DWORD) (microseconds / 1000));
+#else
+	struct timespec time = { (time_t) (microseconds / 1000000), (long) (microseconds % 1000000 * 1000) };
+	nanosleep(&time, NULL);
+#endif
+}
+
+int64_t _RectangleArea(Rectangle a) {
+	return RectangleValid(a) ? (int64_t) (a.r - a.l) * (a.b - a.t) : 0;
+}
+
+int64_t _DamageMergeCost(Rectangle a, Rectangle b) {
+	int64_t covered = _RectangleArea(a) + _RectangleArea(b) - _RectangleArea(RectangleIntersection(a, b));
+	return _RectangleArea(RectangleBounding(a, b)) - covered;
+}
+
+void _DamageRemove(DamageRegion *region, int index) {
+	region->rectangles[index] = region->rectangles[--region->count];
+}
+
+void DamageAdd(DamageRegion *region, Rectangle r) {
+	if (!RectangleValid(r)) {
+		return;
+	}
+
+	// Once r has absorbed another rectangle it only grows, absorbing everything it overlaps instead of being split.
+	// Otherwise, a piece split off r could merge with a neighbour and overlap the same rectangle again, forever.
+	bool grown = false;
+
+	restart:;
+
+	for (int i = 0; i < region->count; i++) {
+		Rectangle e = region->rectangles[i];
+		Rectangle overlap = RectangleIntersection(e, r);
+
+		if (RectangleEquals(overlap, r)) {
+			return;
+		}
+
+		int64_t cost = _DamageMergeCost(e, r);
+		bool merge = RectangleEquals(overlap, e) || cost <= DAMAGE_MERGE_PIXELS || cost * 4 <= _RectangleArea(RectangleBounding(e, r));
+
+		// Splitting can add up to 4 rectangles, so merge instead when the region is nearly full.
+		if (RectangleValid(overlap) && (grown || region->count > DAMAGE_MAX_RECTANGLES - 4)) {
+			merge = true;
+		}
+
+		if (merge) {
+			_DamageRemove(region, i);
+			r = RectangleBounding(e, r);
+			grown = true;
+			goto restart;
+		} else if (RectangleValid(overlap)) {
+			// Add the parts of r outside e separately.
+			DamageAdd(region, RectangleMake(r.l, r.r, r.t, overlap.t));
+			DamageAdd(region, RectangleMake(r.l, r.r, overlap.b, r.b));
+			DamageAdd(region, RectangleMake(r.l, overlap.l, overlap.t, overlap.b));
+			DamageAdd(region, RectangleMake(overlap.r, r.r, overlap.t, overlap.b));
+			return;
+		}
+	}
+
+	if (region->count == DAMAGE_MAX_RECTANGLES) {
+		// Full, so merge with whichever rectangle wastes the fewest pixels.
+		int best = 0;
+
+		for (int i = 1; i < region->count; i++) {
+			if (_DamageMergeCost(region->rectangles[i], r) < _DamageMergeCost(region->rectangles[best], r)) {
+				best = i;
+			}
+		}
+
+		r = RectangleBounding(region->rectangles[best], r);
+		_DamageRemove(region, best);
+		grown = true;
+		goto restart;
+	}
+
+	region->rectangles[region->count++] = r;
+}
+
+#ifdef TOY_TRACE
+
+/////////////////////////////////////////
+// Instrumentation.
+/////////////////////////////////////////
+
+TraceBuffer _traceBuffer;
+
+const char *const _traceMessageNames[] = { "MSG_PAINT", "MSG_LAYOUT", "MSG_UPDATE", "MSG_MOUSE_MOVE", "MSG_DESTROY", "MSG_TIMER", "MSG_USER" };
+
+uint64_t _TraceTime() {
+#ifdef PLATFORM_WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t) (counter.QuadPart / frequency.QuadPart * 1000000000 + counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+uint64_t _TraceThread() {
+#ifdef PLATFORM_WIN32
+	return GetCurrentThreadId();
+#else
+	return (uint64_t) pthread_self();
+#endif
+}
+
+void _TraceRecord(const char *name, const void *element, uint64_t start) {
+	uint64_t end = _TraceTime();
+
+	// Any thread can record; each claims a slot, overwriting the oldest event once the buffer is full.
+#ifdef _MSC_VER
+	uint64_t index = (uint64_t) InterlockedIncrement64((volatile LONG64 *) &_traceBuffer.written) - 1;
+#else
+	uint64_t index = __atomic_fetch_add(&_traceBuffer.written, 1, __ATOMIC_RELAXED);
+#endif
+
+	TraceEvent *event = &_traceBuffer.events[index & (TRACE_BUFFER_EVENTS - 1)];
+	event->name = name;
+	event->element = element;
+	event->start = start;
+	event->duration = end - start;
+	event->thread = _TraceThread();
+}
+
+void _TraceHistogramAdd(uint32_t microseconds, int delta) {
+	uint32_t bucket = microseconds / 500;
+	_traceBuffer.histogram[bucket < TRACE_HISTOGRAM_BUCKETS ? bucket : TRACE_HISTOGRAM_BUCKETS - 1] += delta;
+}
+
+void _TraceFrame(uint64_t start) {
+	uint64_t duration = (_TraceTime() - start) / 1000;
+	uint32_t *slot = &_traceBuffer.frameTimes[_traceBuffer.frames % TRACE_FRAME_HISTORY];
+	if (_traceBuffer.frames >= TRACE_FRAME_HISTORY) _TraceHistogramAdd(*slot, -1); // Drop the frame leaving the history.
+	*slot = duration > UINT32_MAX ? UINT32_MAX : (uint32_t) duration;
+	_TraceHistogramAdd(*slot, 1);
+	_traceBuffer.frames++;
+}
+
+bool TraceWriteJSON(FILE *file) {
+	uint64_t written = _traceBuffer.written;
+	uint64_t first = written > TRACE_BUFFER_EVENTS ? written - TRACE_BUFFER_EVENTS : 0;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (uint64_t i = first; i < written; i++) {
+		TraceEvent *event = &_traceBuffer.events[i & (TRACE_BUFFER_EVENTS - 1)];
+		fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"element\":\"%p\"}}%s\n",
+				event->name, (unsigned long long) event->thread, event->start / 1000.0, event->duration / 1000.0, 
+				event->element, i + 1 == written ? "" : ",");
+	}
+
+	fprintf(file, "]}\n");
+	return !ferror(file);
+}
+
+void TraceWriteHistogram(FILE *file) {
+	uint64_t frames = _traceBuffer.frames < TRACE_FRAME_HISTORY ? _traceBuffer.frames : TRACE_FRAME_HISTORY;
+	uint32_t most = 1;
+	fprintf(file, "frame times over the last %llu frames:\n", (unsigned long long) frames);
+
+	for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; i++) {
+		if (_traceBuffer.histogram[i] > most) most = _traceBuffer.histogram[i];
+	}
+
+	for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; i++) {
+		if (!_traceBuffer.histogram[i]) continue;
+		char bar[41] = { 0 };
+		memset(bar, '#', ((size_t) _traceBuffer.histogram[i] * 40 + most - 1) / most);
+
+		if (i == TRACE_HISTOGRAM_BUCKETS - 1) {
+			fprintf(file, "   >= %4.1f ms %6u %s\n", i * 0.5, _traceBuffer.histogram[i], bar);
+		} else {
+			fprintf(file, "%4.1f-%4.1f ms %6u %s\n", i * 0.5, i * 0.5 + 0.5, _traceBuffer.histogram[i], bar);
+		}
+	}
+}
+
+#endif
+
 /////////////////////////////////////////
 // Painting.
 /////////////////////////////////////////
@@ -202,184 +873,2668 @@ const uint64_t _font[] = {
 	0x1800181818180000UL, 0x0000000018181818UL, 0x18701818180E0000UL, 0x000000000E181818UL, 0x000000003B6E0000UL, 0x0000000000000000UL, 0x63361C0800000000UL, 0x00000000007F6363UL, 
 };
 
-void DrawBlock(Painter *painter, Rectangle rectangle, uint32_t color) {
-	rectangle = RectangleIntersection(painter->clip, rectangle);
+// Fills bigger than this are streamed past the cache with non-temporal stores,
+// since they would evict everything else and are unlikely to be read back soon.
+#define FILL_STREAM_BYTES (4 * 1024 * 1024)
+
+// DrawImage keeps its column tables, and the bilinear source row, on the stack if they fit in this many words.
+// 32 KB covers a 3840 pixel wide clip, or a 1920 pixel wide clip of an image up to 4352 pixels wide.
+#define IMAGE_STACK_WORDS (8192)
 
-	for (int y = rectangle.t; y < rectangle.b; y++) {
-		for (int x = rectangle.l; x < rectangle.r; x++) {
-			painter->bits[y * painter->width + x] = color;
+void _FillScalar(uint32_t *row, int stride, int width, int height, uint32_t color, bool stream) {
+	(void) stream;
+
+	for (int y = 0; y < height; y++, row += stride) {
+		for (int x = 0; x < width; x++) {
+			row[x] = color;
 		}
 	}
 }
 
-void DrawRectangle(Painter *painter, Rectangle r, uint32_t mainColor, uint32_t borderColor) {
-	DrawBlock(painter, RectangleMake(r.l, r.r, r.t, r.t + 1), borderColor);
-	DrawBlock(painter, RectangleMake(r.l, r.l + 1, r.t + 1, r.b - 1), borderColor);
-	DrawBlock(painter, RectangleMake(r.r - 1, r.r, r.t + 1, r.b - 1), borderColor);
-	DrawBlock(painter, RectangleMake(r.l, r.r, r.b - 1, r.b), borderColor);
-	DrawBlock(painter, RectangleMake(r.l + 1, r.r - 1, r.t + 1, r.b - 1), mainColor);
-}
+#ifdef ARCH_X86
 
-void DrawString(Painter *painter, Rectangle bounds, const char *string, size_t bytes, uint32_t color, bool centerAlign) {
-	Rectangle oldClip = painter->clip;
-	painter->clip = RectangleIntersection(bounds, oldClip);
-	int x = bounds.l;
-	int y = (bounds.t + bounds.b - GLYPH_HEIGHT) / 2;
+TARGET("sse2") void _FillSSE2(uint32_t *row, int stride, int width, int height, uint32_t color, bool stream) {
+	__m128i wide = _mm_set1_epi32((int) color);
 
-	if (centerAlign) {
-		x += (bounds.r - bounds.l - bytes * GLYPH_WIDTH) / 2;
-	}
+	for (int y = 0; y < height; y++, row += stride) {
+		uint32_t *bits = row, *end = row + width;
+		while (bits < end && ((uintptr_t) bits & 15)) *bits++ = color;
+
+		if (stream) {
+			for (; end - bits >= 4; bits += 4) _mm_stream_si128((__m128i *) bits, wide);
+		} else {
+			for (; end - bits >= 4; bits += 4) _mm_store_si128((__m128i *) bits, wide);
+		}
 
-	for (uintptr_t i = 0; i < bytes; i++) {
-		uint8_t c = string[i];
-		if (c > 127) c = '?';
+		while (bits < end) *bits++ = color;
+	}
 
-		Rectangle rectangle = RectangleIntersection(painter->clip, RectangleMake(x, x + 8, y, y + 16));
-		const uint8_t *data = (const uint8_t *) _font + c * 16;
+	if (stream) _mm_sfence();
+}
 
-		for (int i = rectangle.t; i < rectangle.b; i++) {
-			uint32_t *bits = painter->bits + i * painter->width + rectangle.l;
-			uint8_t byte = data[i - y];
+TARGET("avx2") void _FillAVX2(uint32_t *row, int stride, int width, int height, uint32_t color, bool stream) {
+	__m256i wide = _mm256_set1_epi32((int) color);
 
-			for (int j = rectangle.l; j < rectangle.r; j++) {
-				if (byte & (1 << (j - x))) {
-					*bits = color;
-				}
+	for (int y = 0; y < height; y++, row += stride) {
+		uint32_t *bits = row, *end = row + width;
+		while (bits < end && ((uintptr_t) bits & 31)) *bits++ = color;
 
-				bits++;
+		if (stream) {
+			for (; end - bits >= 8; bits += 8) _mm256_stream_si256((__m256i *) bits, wide);
+		} else {
+			for (; end - bits >= 16; bits += 16) {
+				_mm256_store_si256((__m256i *) bits + 0, wide);
+				_mm256_store_si256((__m256i *) bits + 1, wide);
 			}
+
+			if (end - bits >= 8) _mm256_store_si256((__m256i *) bits, wide), bits += 8;
 		}
 
-		x += GLYPH_WIDTH;
+		while (bits < end) *bits++ = color;
 	}
 
-	painter->clip = oldClip;
+	if (stream) _mm_sfence();
 }
 
-/////////////////////////////////////////
-// Core user interface logic.
-/////////////////////////////////////////
+TARGET("avx512f") void _FillAVX512(uint32_t *row, int stride, int width, int height, uint32_t color, bool stream) {
+	__m512i wide = _mm512_set1_epi32((int) color);
 
-void _WindowEndPaint(Window *window, Painter *painter);
+	for (int y = 0; y < height; y++, row += stride) {
+		uint32_t *bits = row, *end = row + width;
 
-GlobalState global;
+		// Use a masked store to reach 64 byte alignment, and another for the tail.
+		int head = (int) ((64 - ((uintptr_t) bits & 63)) & 63) / 4;
+		if (head > width) head = width;
+		if (head) _mm512_mask_storeu_epi32(bits, (__mmask16) ((1 << head) - 1), wide), bits += head;
 
-void _ElementPaint(Element *element, Painter *painter) {
-	Rectangle clip = RectangleIntersection(element->clip, painter->clip);
+		if (stream) {
+			for (; end - bits >= 16; bits += 16) _mm512_stream_si512((void *) bits, wide);
+		} else {
+			for (; end - bits >= 16; bits += 16) _mm512_store_si512((void *) bits, wide);
+		}
 
-	if (!RectangleValid(clip)) {
-		return;
+		int tail = (int) (end - bits);
+		if (tail) _mm512_mask_storeu_epi32(bits, (__mmask16) ((1 << tail) - 1), wide);
 	}
 
-	painter->clip = clip;
-	ElementMessage(element, MSG_PAINT, 0, painter);
-
-	for (uintptr_t i = 0; i < element->childCount; i++) {
-		painter->clip = clip;
-		_ElementPaint(element->children[i], painter);
-	}
+	if (stream) _mm_sfence();
 }
 
-Element *ElementFindByPoint(Element *element, int x, int y) {
-	for (uintptr_t i = 0; i < element->childCount; i++) {
-		if (RectangleContains(element->children[i]->clip, x, y)) {
-			return ElementFindByPoint(element->children[i], x, y);
-		}
-	}
+#endif
 
-	return element;
-}
+// Each glyph row byte expanded to 8 pixel masks, for masked stores. Built by _DrawInitialise.
+uint32_t _glyphRowMasks[256][8];
 
-void _Update() {
-	for (uintptr_t i = 0; i < global.windowCount; i++) {
-		Window *window = global.windows[i];
+#define GLYPH_DATA(c) ((const uint8_t *) _font + ((uint8_t) (c) > 127 ? '?' : (uint8_t) (c)) * 16)
+#define GLYPH_CLIP(i, count, firstMask, lastMask) \
+	((uint8_t) (((i) == 0 ? (firstMask) : 0xFF) & ((i) == (count) - 1 ? (lastMask) : 0xFF)))
 
-		if (RectangleValid(window->updateRegion)) {
-			Painter painter;
-			painter.bits = window->bits;
-			painter.width = window->width;
-			painter.height = window->height;
-			painter.clip = RectangleIntersection(RectangleMake(0, window->width, 0, window->height), window->updateRegion);
-			_ElementPaint(&window->e, &painter);
-			_WindowEndPaint(window, &painter);
-			window->updateRegion = RectangleMake(0, 0, 0, 0);
+void _TextScalar(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
+		uint32_t *row = bits;
+
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j] & clip;
+
+			for (int k = 0; byte; k++, byte >>= 1) {
+				if (byte & 1) row[k] = color;
+			}
 		}
 	}
 }
 
-void _WindowInputEvent(Window *window, Message message, int di, void *dp) {
-	Element *hovered = ElementFindByPoint(&window->e, window->cursorX, window->cursorY);
+#ifdef ARCH_X86
 
-	if (message == MSG_MOUSE_MOVE) {
-		ElementMessage(hovered, MSG_MOUSE_MOVE, di, dp);
-	}
+TARGET("sse2") void _TextSSE2(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	__m128i wide = _mm_set1_epi32((int) color);
 
-	if (hovered != window->hovered) {
-		Element *previous = window->hovered;
-		window->hovered = hovered;
-		ElementMessage(previous, MSG_UPDATE, UPDATE_HOVERED, 0);
-		ElementMessage(window->hovered, MSG_UPDATE, UPDATE_HOVERED, 0);
-	}
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
 
-	_Update();
-}
+		if (clip != 0xFF) {
+			// SSE2 has no masked store, and the blend below would touch pixels outside the clip.
+			_TextScalar(bits, stride, string + i, 1, rowStart, rowEnd, clip, clip, color);
+			continue;
+		}
 
-void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout) {
-	Rectangle oldClip = element->clip;
-	element->clip = RectangleIntersection(element->parent->clip, bounds);
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint32_t *row = bits;
 
-	if (!RectangleEquals(element->bounds, bounds) || !RectangleEquals(element->clip, oldClip) || alwaysLayout) {
-		element->bounds = bounds;
-		ElementMessage(element, MSG_LAYOUT, 0, 0);
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j];
+			if (!byte) continue;
+			__m128i *pixels = (__m128i *) row;
+			__m128i mask0 = _mm_loadu_si128((const __m128i *) _glyphRowMasks[byte] + 0);
+			__m128i mask1 = _mm_loadu_si128((const __m128i *) _glyphRowMasks[byte] + 1);
+			_mm_storeu_si128(pixels + 0, _mm_or_si128(_mm_andnot_si128(mask0, _mm_loadu_si128(pixels + 0)), _mm_and_si128(mask0, wide)));
+			_mm_storeu_si128(pixels + 1, _mm_or_si128(_mm_andnot_si128(mask1, _mm_loadu_si128(pixels + 1)), _mm_and_si128(mask1, wide)));
+		}
 	}
 }
 
-void ElementRepaint(Element *element, Rectangle *region) {
-	if (!region) {
-		region = &element->bounds;
-	}
+TARGET("avx2") void _TextAVX2(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	__m256i wide = _mm256_set1_epi32((int) color);
 
-	Rectangle r = RectangleIntersection(*region, element->clip);
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
+		uint32_t *row = bits;
 
-	if (RectangleValid(r)) {
-		if (RectangleValid(element->window->updateRegion)) {
-			element->window->updateRegion = RectangleBounding(element->window->updateRegion, r);
-		} else {
-			element->window->updateRegion = r;
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j] & clip;
+			if (!byte) continue;
+			// Masked-off lanes are never accessed, so this is safe at the edges of the clip.
+			_mm256_maskstore_epi32((int *) row, _mm256_loadu_si256((const __m256i *) _glyphRowMasks[byte]), wide);
 		}
 	}
 }
 
-int ElementMessage(Element *element, Message message, int di, void *dp) {
-	if (element->messageUser) {
-		int result = element->messageUser(element, message, di, dp);
+#endif
 
-		if (result) {
-			return result;
-		}
-	}
+// Blending computes source + destination * (255 - alpha) / 255 for each channel, rounded to nearest.
+// For x up to 255 * 255, (x + 128 + ((x + 128) >> 8)) >> 8 is exactly x / 255 rounded.
 
-	if (element->messageClass) {
-		return element->messageClass(element, message, di, dp);
-	} else {
-		return 0;
-	}
+uint32_t _BlendPixel(uint32_t destination, uint32_t color) {
+	uint32_t inverse = 255 - (color >> 24);
+	uint32_t rb = (destination & 0x00FF00FF) * inverse + 0x00800080;
+	uint32_t ag = ((destination >> 8) & 0x00FF00FF) * inverse + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+	return color + (rb | ag);
 }
 
-Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass)  {
-	Element *element = (Element *) calloc(1, bytes);
+void _BlendScalar(uint32_t *row, int stride, int width, int height, uint32_t color) {
+	for (int y = 0; y < height; y++, row += stride) {
+		for (int x = 0; x < width; x++) {
+			row[x] = _BlendPixel(row[x], color);
+		}
+	}
+}
+
+void _TextBlendScalar(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
+		uint32_t *row = bits;
+
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j] & clip;
+
+			for (int k = 0; byte; k++, byte >>= 1) {
+				if (byte & 1) row[k] = _BlendPixel(row[k], color);
+			}
+		}
+	}
+}
+
+// Interpolates each channel from a to b, by weight out of 256.
+uint32_t _ImageLerpPixel(uint32_t a, uint32_t b, uint32_t weight) {
+	uint32_t rb = ((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8;
+	uint32_t ag = ((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight;
+	return (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+}
+
+void _ImageNearestScalar(uint32_t *row, int width, const uint32_t *top, const uint32_t *bottom, int bottomWeight, 
+		const int32_t *columns, const uint32_t *weights, uint32_t *scratch) {
+	(void) bottom, (void) bottomWeight, (void) weights, (void) scratch;
+
+	for (int x = 0; x < width; x++) {
+		row[x] = top[columns[x]];
+	}
+}
+
+void _ImageBilinearScalar(uint32_t *row, int width, const uint32_t *top, const uint32_t *bottom, int bottomWeight, 
+		const int32_t *columns, const uint32_t *weights, uint32_t *scratch) {
+	(void) scratch;
+
+	for (int x = 0; x < width; x++) {
+		int32_t c = columns[x];
+		uint32_t left = _ImageLerpPixel(top[c], bottom[c], bottomWeight);
+		uint32_t right = _ImageLerpPixel(top[c + 1], bottom[c + 1], bottomWeight);
+		row[x] = _ImageLerpPixel(left, right, weights[x] >> 16);
+	}
+}
+
+#ifdef ARCH_X86
+
+// Blends 4 pixels, with source being the color in each lane and inverse being 255 - alpha in each 16-bit lane.
+TARGET("sse2") static inline __m128i _Blend4(__m128i pixels, __m128i source, __m128i inverse) {
+	__m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+	__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), inverse), bias);
+	__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), inverse), bias);
+	low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+	high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+	return _mm_add_epi8(_mm_packus_epi16(low, high), source);
+}
+
+TARGET("avx2") static inline __m256i _Blend8(__m256i pixels, __m256i source, __m256i inverse) {
+	__m256i zero = _mm256_setzero_si256(), bias = _mm256_set1_epi16(128);
+	__m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero), inverse), bias);
+	__m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero), inverse), bias);
+	low = _mm256_srli_epi16(_mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+	high = _mm256_srli_epi16(_mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+	return _mm256_add_epi8(_mm256_packus_epi16(low, high), source); // Unpack and pack both work within 128-bit halves.
+}
+
+TARGET("sse2") void _BlendSSE2(uint32_t *row, int stride, int width, int height, uint32_t color) {
+	__m128i source = _mm_set1_epi32((int) color), inverse = _mm_set1_epi16((short) (255 - (color >> 24)));
+
+	for (int y = 0; y < height; y++, row += stride) {
+		int x = 0;
+
+		for (; x + 8 <= width; x += 8) {
+			__m128i *pixels = (__m128i *) (row + x);
+			_mm_storeu_si128(pixels + 0, _Blend4(_mm_loadu_si128(pixels + 0), source, inverse));
+			_mm_storeu_si128(pixels + 1, _Blend4(_mm_loadu_si128(pixels + 1), source, inverse));
+		}
+
+		for (; x < width; x++) row[x] = _BlendPixel(row[x], color);
+	}
+}
+
+TARGET("avx2") void _BlendAVX2(uint32_t *row, int stride, int width, int height, uint32_t color) {
+	__m256i source = _mm256_set1_epi32((int) color), inverse = _mm256_set1_epi16((short) (255 - (color >> 24)));
+
+	for (int y = 0; y < height; y++, row += stride) {
+		int x = 0;
+
+		for (; x + 16 <= width; x += 16) {
+			__m256i *pixels = (__m256i *) (row + x);
+			_mm256_storeu_si256(pixels + 0, _Blend8(_mm256_loadu_si256(pixels + 0), source, inverse));
+			_mm256_storeu_si256(pixels + 1, _Blend8(_mm256_loadu_si256(pixels + 1), source, inverse));
+		}
+
+		if (x < width) {
+			// Masked-off lanes are never accessed.
+			int tail = width - x < 8 ? width - x : 8;
+			__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(tail), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			__m256i pixels = _mm256_maskload_epi32((const int *) (row + x), mask);
+			_mm256_maskstore_epi32((int *) (row + x), mask, _Blend8(pixels, source, inverse));
+			x += tail;
+		}
+
+		for (; x < width; x++) row[x] = _BlendPixel(row[x], color);
+	}
+}
+
+TARGET("sse2") void _TextBlendSSE2(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	__m128i source = _mm_set1_epi32((int) color), inverse = _mm_set1_epi16((short) (255 - (color >> 24)));
+
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
+
+		if (clip != 0xFF) {
+			// As in _TextSSE2, the pixels outside the clip must not be touched.
+			_TextBlendScalar(bits, stride, string + i, 1, rowStart, rowEnd, clip, clip, color);
+			continue;
+		}
+
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint32_t *row = bits;
+
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j];
+			if (!byte) continue;
+			__m128i *pixels = (__m128i *) row;
+			__m128i mask0 = _mm_loadu_si128((const __m128i *) _glyphRowMasks[byte] + 0);
+			__m128i mask1 = _mm_loadu_si128((const __m128i *) _glyphRowMasks[byte] + 1);
+			__m128i old0 = _mm_loadu_si128(pixels + 0), old1 = _mm_loadu_si128(pixels + 1);
+			__m128i new0 = _Blend4(old0, source, inverse), new1 = _Blend4(old1, source, inverse);
+			_mm_storeu_si128(pixels + 0, _mm_or_si128(_mm_andnot_si128(mask0, old0), _mm_and_si128(mask0, new0)));
+			_mm_storeu_si128(pixels + 1, _mm_or_si128(_mm_andnot_si128(mask1, old1), _mm_and_si128(mask1, new1)));
+		}
+	}
+}
+
+TARGET("avx2") void _TextBlendAVX2(uint32_t *bits, int stride, const char *string, int count, 
+		int rowStart, int rowEnd, uint8_t firstMask, uint8_t lastMask, uint32_t color) {
+	__m256i source = _mm256_set1_epi32((int) color), inverse = _mm256_set1_epi16((short) (255 - (color >> 24)));
+
+	for (int i = 0; i < count; i++, bits += GLYPH_WIDTH) {
+		const uint8_t *data = GLYPH_DATA(string[i]);
+		uint8_t clip = GLYPH_CLIP(i, count, firstMask, lastMask);
+		uint32_t *row = bits;
+
+		for (int j = rowStart; j < rowEnd; j++, row += stride) {
+			uint8_t byte = data[j] & clip;
+			if (!byte) continue;
+			__m256i mask = _mm256_loadu_si256((const __m256i *) _glyphRowMasks[byte]);
+			__m256i pixels = _mm256_maskload_epi32((const int *) row, mask);
+			_mm256_maskstore_epi32((int *) row, mask, _Blend8(pixels, source, inverse));
+		}
+	}
+}
+
+// Interpolates the two source rows into scratch first, over the columns that are read, then between pairs of columns.
+TARGET("sse2") void _ImageBilinearSSE2(uint32_t *row, int width, const uint32_t *top, const uint32_t *bottom, int bottomWeight, 
+		const int32_t *columns, const uint32_t *weights, uint32_t *scratch) {
+	__m128i zero = _mm_setzero_si128();
+	const uint32_t *source = top;
+
+	if (bottomWeight) {
+		__m128i topWeight = _mm_set1_epi16((short) (256 - bottomWeight)), bottomWeights = _mm_set1_epi16((short) bottomWeight);
+		int x = columns[0], last = columns[width - 1] + 1;
+
+		for (; x + 4 <= last + 1; x += 4) {
+			__m128i a = _mm_loadu_si128((__m128i *) (top + x)), b = _mm_loadu_si128((__m128i *) (bottom + x));
+			// The sums fit in 16 bits unsigned, since the weights add up to 256.
+			__m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), topWeight), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), bottomWeights));
+			__m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), topWeight), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), bottomWeights));
+			_mm_storeu_si128((__m128i *) (scratch + x), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+		}
+
+		for (; x <= last; x++) scratch[x] = _ImageLerpPixel(top[x], bottom[x], bottomWeight);
+		source = scratch;
+	}
+
+	int x = 0;
+
+	for (; x + 2 <= width; x += 2) {
+		// Interleave the channels of each pair of source pixels, so one multiply-add interpolates all four channels.
+		__m128i p0 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) source[columns[x]]), _mm_cvtsi32_si128((int) source[columns[x] + 1]));
+		__m128i p1 = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) source[columns[x + 1]]), _mm_cvtsi32_si128((int) source[columns[x + 1] + 1]));
+		__m128i s0 = _mm_madd_epi16(_mm_unpacklo_epi8(p0, zero), _mm_set1_epi32((int) weights[x]));
+		__m128i s1 = _mm_madd_epi16(_mm_unpacklo_epi8(p1, zero), _mm_set1_epi32((int) weights[x + 1]));
+		__m128i packed = _mm_packs_epi32(_mm_srli_epi32(s0, 8), _mm_srli_epi32(s1, 8));
+		_mm_storel_epi64((__m128i *) (row + x), _mm_packus_epi16(packed, packed));
+	}
+
+	for (; x < width; x++) {
+		row[x] = _ImageLerpPixel(source[columns[x]], source[columns[x] + 1], weights[x] >> 16);
+	}
+}
+
+TARGET("avx2") void _ImageNearestAVX2(uint32_t *row, int width, const uint32_t *top, const uint32_t *bottom, int bottomWeight, 
+		const int32_t *columns, const uint32_t *weights, uint32_t *scratch) {
+	(void) bottom, (void) bottomWeight, (void) weights, (void) scratch;
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m256i indices = _mm256_loadu_si256((__m256i *) (columns + x));
+		_mm256_storeu_si256((__m256i *) (row + x), _mm256_i32gather_epi32((const int *) top, indices, 4));
+	}
+
+	for (; x < width; x++) row[x] = top[columns[x]];
+}
+
+#endif
+
+// In order of preference, best last.
+const DrawKernel _drawKernels[] = {
+	{ "scalar", _FillScalar, _TextScalar, _BlendScalar, _TextBlendScalar, _ImageNearestScalar, _ImageBilinearScalar, 0 },
+#ifdef ARCH_X86
+	// Without gathers, nearest filtering is scalar loads either way. Bilinear filtering is limited by the per-pixel loads, so it stays at SSE2 width.
+	{ "sse2", _FillSSE2, _TextSSE2, _BlendSSE2, _TextBlendSSE2, _ImageNearestScalar, _ImageBilinearSSE2, CPU_SSE2 },
+	{ "avx2", _FillAVX2, _TextAVX2, _BlendAVX2, _TextBlendAVX2, _ImageNearestAVX2, _ImageBilinearSSE2, CPU_AVX2 },
+	// 16-bit multiplies on 512-bit vectors need AVX-512BW, so blending stays at AVX2 width.
+	{ "avx512", _FillAVX512, _TextAVX2, _BlendAVX2, _TextBlendAVX2, _ImageNearestAVX2, _ImageBilinearSSE2, CPU_AVX2 | CPU_AVX512 },
+#endif
+};
+
+uint32_t _cpuFeatures;
+
+// Replaced by _DrawInitialise.
+FillFunction _drawFill = _FillScalar; 
+TextFunction _drawText = _TextScalar;
+BlendFunction _drawBlend = _BlendScalar;
+TextFunction _drawBlendText = _TextBlendScalar;
+ImageRowFunction _drawImageNearest = _ImageNearestScalar;
+ImageRowFunction _drawImageBilinear = _ImageBilinearScalar;
+
+void _DrawInitialise() {
+	_cpuFeatures = 0;
+
+#if defined(ARCH_X86) && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) _cpuFeatures |= CPU_SSE2;
+	if (__builtin_cpu_supports("avx2")) _cpuFeatures |= CPU_AVX2;
+	if (__builtin_cpu_supports("avx512f")) _cpuFeatures |= CPU_AVX512;
+#elif defined(ARCH_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	uint64_t xcr0 = (info[2] & (1 << 27)) ? _xgetbv(0) : 0;
+	if (info[3] & (1 << 26)) _cpuFeatures |= CPU_SSE2;
+	__cpuidex(info, 7, 0);
+	if ((xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5))) _cpuFeatures |= CPU_AVX2;
+	if ((xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16))) _cpuFeatures |= CPU_AVX512;
+#endif
+
+	for (uintptr_t i = 0; i < sizeof(_drawKernels) / sizeof(_drawKernels[0]); i++) {
+		if ((_drawKernels[i].cpuFeatures & _cpuFeatures) == _drawKernels[i].cpuFeatures) {
+			_drawFill = _drawKernels[i].fill;
+			_drawText = _drawKernels[i].text;
+			_drawBlend = _drawKernels[i].blend;
+			_drawBlendText = _drawKernels[i].blendText;
+			_drawImageNearest = _drawKernels[i].imageNearest;
+			_drawImageBilinear = _drawKernels[i].imageBilinear;
+		}
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int j = 0; j < 8; j++) {
+			_glyphRowMasks[i][j] = (i & (1 << j)) ? 0xFFFFFFFF : 0;
+		}
+	}
+}
+
+void DrawBlock(Painter *painter, Rectangle rectangle, uint32_t color) {
+	rectangle = RectangleIntersection(painter->clip, rectangle);
+
+	if (!RectangleValid(rectangle)) {
+		return;
+	}
+
+	int width = rectangle.r - rectangle.l, height = rectangle.b - rectangle.t;
+	bool stream = (size_t) width * height * 4 >= FILL_STREAM_BYTES;
+	_drawFill(painter->bits + rectangle.t * painter->stride + rectangle.l, painter->stride, width, height, color, stream);
+}
+
+void DrawRectangle(Painter *painter, Rectangle r, uint32_t mainColor, uint32_t borderColor) {
+	DrawBlock(painter, RectangleMake(r.l, r.r, r.t, r.t + 1), borderColor);
+	DrawBlock(painter, RectangleMake(r.l, r.l + 1, r.t + 1, r.b - 1), borderColor);
+	DrawBlock(painter, RectangleMake(r.r - 1, r.r, r.t + 1, r.b - 1), borderColor);
+	DrawBlock(painter, RectangleMake(r.l, r.r, r.b - 1, r.b), borderColor);
+	DrawBlock(painter, RectangleMake(r.l + 1, r.r - 1, r.t + 1, r.b - 1), mainColor);
+}
+
+void _DrawString(Painter *painter, Rectangle bounds, const char *string, size_t bytes, uint32_t color, bool centerAlign, TextFunction text) {
+	Rectangle clip = RectangleIntersection(bounds, painter->clip);
+	int x = bounds.l;
+	int y = bounds.t + (bounds.b - bounds.t - GLYPH_HEIGHT) / 2; // Relative to the top, so it rounds the same way wherever the bounds are.
+
+	if (centerAlign) {
+		x += (bounds.r - bounds.l - (int) bytes * GLYPH_WIDTH) / 2;
+	}
+
+	// Clip the whole string once: find the visible rows, and the range of glyphs that intersect the clip.
+	// Only the first and last of those glyphs can be partially clipped horizontally.
+
+	int rowStart = clip.t > y ? clip.t - y : 0;
+	int rowEnd = clip.b - y < GLYPH_HEIGHT ? clip.b - y : GLYPH_HEIGHT;
+
+	if (!RectangleValid(clip) || rowStart >= rowEnd || clip.r <= x) {
+		return;
+	}
+
+	int first = clip.l > x ? (clip.l - x) / GLYPH_WIDTH : 0;
+	int last = (clip.r - x + GLYPH_WIDTH - 1) / GLYPH_WIDTH;
+	if (last > (int) bytes) last = (int) bytes;
+
+	if (first >= last) {
+		return;
+	}
+
+	int firstShift = clip.l - (x + first * GLYPH_WIDTH);
+	int lastColumns = clip.r - (x + (last - 1) * GLYPH_WIDTH);
+	uint8_t firstMask = firstShift <= 0 ? 0xFF : firstShift >= 8 ? 0 : (uint8_t) (0xFF << firstShift);
+	uint8_t lastMask = lastColumns >= 8 ? 0xFF : (uint8_t) ((1 << lastColumns) - 1);
+
+	text(painter->bits + (y + rowStart) * painter->stride + x + first * GLYPH_WIDTH, painter->stride, 
+			string + first, last - first, rowStart, rowEnd, firstMask, lastMask, color);
+}
+
+void DrawString(Painter *painter, Rectangle bounds, const char *string, size_t bytes, uint32_t color, bool centerAlign) {
+	_DrawString(painter, bounds, string, bytes, color, centerAlign, _drawText);
+}
+
+void DrawBlockBlend(Painter *painter, Rectangle rectangle, uint32_t color) {
+	if ((color >> 24) == 0xFF) {
+		DrawBlock(painter, rectangle, color);
+		return;
+	}
+
+	rectangle = RectangleIntersection(painter->clip, rectangle);
+
+	if (!RectangleValid(rectangle) || !color) {
+		return;
+	}
+
+	_drawBlend(painter->bits + rectangle.t * painter->stride + rectangle.l, painter->stride, 
+			rectangle.r - rectangle.l, rectangle.b - rectangle.t, color);
+}
+
+void DrawRectangleBlend(Painter *painter, Rectangle r, uint32_t mainColor, uint32_t borderColor) {
+	DrawBlockBlend(painter, RectangleMake(r.l, r.r, r.t, r.t + 1), borderColor);
+	DrawBlockBlend(painter, RectangleMake(r.l, r.l + 1, r.t + 1, r.b - 1), borderColor);
+	DrawBlockBlend(painter, RectangleMake(r.r - 1, r.r, r.t + 1, r.b - 1), borderColor);
+	DrawBlockBlend(painter, RectangleMake(r.l, r.r, r.b - 1, r.b), borderColor);
+	DrawBlockBlend(painter, RectangleMake(r.l + 1, r.r - 1, r.t + 1, r.b - 1), mainColor);
+}
+
+void DrawStringBlend(Painter *painter, Rectangle bounds, const char *string, size_t bytes, uint32_t color, bool centerAlign) {
+	if (color >> 24) {
+		_DrawString(painter, bounds, string, bytes, color, centerAlign, (color >> 24) == 0xFF ? _drawText : _drawBlendText);
+	}
+}
+
+// Finds where destination pixel i of count comes from in a source of the given size, sampling at pixel centres.
+void _ImageSample(int i, int count, int size, int filter, int32_t *index, uint32_t *weights) {
+	if (filter == IMAGE_NEAREST) {
+		int64_t s = (int64_t) (2 * i + 1) * size / (2 * (int64_t) count);
+		*index = (int32_t) (s < size ? s : size - 1);
+		*weights = 256;
+	} else {
+		// In 256ths of a pixel, from the centre of the first source pixel. The last pixel is reached as the first of a pair with all the weight on the second.
+		int64_t s = (int64_t) (2 * i + 1) * size * 256 / (2 * (int64_t) count) - 128;
+		if (s < 0) s = 0;
+		if (s > (int64_t) (size - 1) * 256) s = (int64_t) (size - 1) * 256;
+		int32_t c = (int32_t) (s >> 8);
+		uint32_t w = (uint32_t) (s & 0xFF);
+		if (c == size - 1) c--, w = 256;
+		*index = c;
+		*weights = (256 - w) | (w << 16);
+	}
+}
+
+void DrawImage(Painter *painter, Rectangle bounds, const uint32_t *bits, int width, int height, int stride, int filter) {
+	Rectangle clip = RectangleIntersection(painter->clip, bounds);
+
+	if (!RectangleValid(clip) || width <= 0 || height <= 0) {
+		return;
+	}
+
+	int boundsWidth = bounds.r - bounds.l, boundsHeight = bounds.b - bounds.t, clipWidth = clip.r - clip.l;
+	uint32_t *destination = painter->bits + clip.t * painter->stride + clip.l;
+
+	if (boundsWidth == width && boundsHeight == height) {
+		const uint32_t *source = bits + (clip.t - bounds.t) * stride + (clip.l - bounds.l);
+
+		for (int y = clip.t; y < clip.b; y++, destination += painter->stride, source += stride) {
+			memcpy(destination, source, clipWidth * 4);
+		}
+
+		return;
+	}
+
+	// Bilinear filtering reads pairs of pixels in both directions.
+	if (width < 2 || height < 2) filter = IMAGE_NEAREST;
+
+	// Work out where each column comes from once, rather than on every row.
+	// Only bilinear filtering needs the scratch row. Painting is often on the parallel workers, so avoid the allocator where possible.
+	uint32_t stack[IMAGE_STACK_WORDS];
+	size_t words = (size_t) clipWidth * 2 + (filter == IMAGE_BILINEAR ? width : 0);
+	int32_t *columns = words <= IMAGE_STACK_WORDS ? (int32_t *) stack : (int32_t *) malloc(words * 4);
+	if (!columns) return;
+	uint32_t *weights = (uint32_t *) (columns + clipWidth), *scratch = weights + clipWidth;
+
+	for (int x = 0; x < clipWidth; x++) {
+		_ImageSample(clip.l - bounds.l + x, boundsWidth, width, filter, &columns[x], &weights[x]);
+	}
+
+	ImageRowFunction function = filter == IMAGE_BILINEAR ? _drawImageBilinear : _drawImageNearest;
+
+	for (int y = clip.t; y < clip.b; y++, destination += painter->stride) {
+		int32_t row;
+		uint32_t rowWeights;
+		_ImageSample(y - bounds.t, boundsHeight, height, filter, &row, &rowWeights);
+		const uint32_t *top = bits + (size_t) row * stride;
+		function(destination, clipWidth, top, filter == IMAGE_BILINEAR ? top + stride : top, rowWeights >> 16, columns, weights, scratch);
+	}
+
+	if (columns != (int32_t *) stack) free(columns);
+}
+
+/////////////////////////////////////////
+// Core user interface logic.
+/////////////////////////////////////////
+
+void _WindowBeginPaint(Window *window);
+void _WindowEndPaint(Window *window, Painter *painter);
+void _WindowScroll(Window *window, Rectangle destination, int dx, int dy);
+void _ParallelPaint(Window *window);
+void _WindowPresent(PresentBuffer *buffer);
+void _PresentQueue(Window *window);
+void _PresentFlush();
+void _PresentBufferReserve(PresentBuffer *buffer, int stride, int height);
+void _PresentBufferFree(PresentBuffer *buffer);
+void _MessageQueueForget(Element *element);
+void _WindowResize(Window *window, int width, int height);
+void _WindowExpose(Window *window, DamageRegion *region);
+void _InputRecord(Window *window, int type, int a, int b);
+uint64_t _InputArrivalTime();
+void _InputLatency(uint64_t latency);
+
+GlobalState global;
+
+bool _ElementWantsMessage(Element *element, Message message) {
+	uint32_t bit = MESSAGE_BIT(message);
+	return (element->messageUser && (element->userMessages & bit)) || (element->messageClass && (element->classMessages & bit));
+}
+
+void _ChildClipsSet(Element *element, uint32_t i, Rectangle clip) {
+	CHILD_CLIP_L(element, i) = clip.l;
+	CHILD_CLIP_R(element, i) = clip.r;
+	CHILD_CLIP_T(element, i) = clip.t;
+	CHILD_CLIP_B(element, i) = clip.b;
+}
+
+void _ChildClipsGrow(Element *element, uint32_t capacity) {
+	int *clips = (int *) calloc(capacity * 4, sizeof(int));
+
+	for (uint32_t edge = 0; edge < 4 && element->childClips; edge++) {
+		memcpy(clips + capacity * edge, element->childClips + element->childCapacity * edge, element->childCount * sizeof(int));
+	}
+
+	free(element->childClips);
+	element->childClips = clips;
+}
+
+void _ChildClipsRemove(Element *element, uint32_t i) {
+	for (uint32_t edge = 0; edge < 4; edge++) {
+		int *clips = element->childClips + element->childCapacity * edge;
+		memmove(clips + i, clips + i + 1, (element->childCount - i) * sizeof(int));
+		clips[element->childCount] = 0;
+	}
+}
+
+// Equivalent to RectangleValid(RectangleIntersection(element->children[i]->clip, r)), without touching the child.
+bool _ChildClipIntersects(Element *element, uint32_t i, Rectangle r) {
+	return CHILD_CLIP_L(element, i) < r.r && CHILD_CLIP_R(element, i) > r.l && CHILD_CLIP_R(element, i) > CHILD_CLIP_L(element, i)
+		&& CHILD_CLIP_T(element, i) < r.b && CHILD_CLIP_B(element, i) > r.t && CHILD_CLIP_B(element, i) > CHILD_CLIP_T(element, i)
+		&& r.r > r.l && r.b > r.t;
+}
+
+bool _ChildClipContains(Element *element, uint32_t i, int x, int y) {
+	return CHILD_CLIP_L(element, i) <= x && CHILD_CLIP_R(element, i) > x && CHILD_CLIP_T(element, i) <= y && CHILD_CLIP_B(element, i) > y;
+}
+
+// Returns which of the four children from i onwards have a clip intersecting the rectangle, as a bit mask.
+// The capacity is a multiple of 4 and the unused entries never intersect, so callers can always test whole groups.
+static inline uint32_t _ChildClipsIntersecting(Element *element, uint32_t i, Rectangle rectangle) {
+#if defined(__SSE2__) || defined(_M_X64)
+	if (!RectangleValid(rectangle)) return 0;
+	__m128i l = _mm_load_si128((__m128i *) &CHILD_CLIP_L(element, i)), r = _mm_load_si128((__m128i *) &CHILD_CLIP_R(element, i));
+	__m128i t = _mm_load_si128((__m128i *) &CHILD_CLIP_T(element, i)), b = _mm_load_si128((__m128i *) &CHILD_CLIP_B(element, i));
+	__m128i rl = _mm_set1_epi32(rectangle.l), rr = _mm_set1_epi32(rectangle.r);
+	__m128i rt = _mm_set1_epi32(rectangle.t), rb = _mm_set1_epi32(rectangle.b);
+	__m128i horizontal = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(rr, l), _mm_cmpgt_epi32(r, rl)), _mm_cmpgt_epi32(r, l));
+	__m128i vertical = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(rb, t), _mm_cmpgt_epi32(b, rt)), _mm_cmpgt_epi32(b, t));
+	return _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(horizontal, vertical)));
+#else
+	uint32_t mask = 0;
+	for (uint32_t j = 0; j < 4; j++) if (_ChildClipIntersects(element, i + j, rectangle)) mask |= 1 << j;
+	return mask;
+#endif
+}
+
+// Returns the index of the first child whose clip contains the point, or childCount if there isn't one.
+uint32_t _ChildClipsFind(Element *element, int x, int y) {
+#if defined(__SSE2__) || defined(_M_X64)
+	// Test four children at a time, as in _ChildClipsIntersecting.
+	__m128i px = _mm_set1_epi32(x), py = _mm_set1_epi32(y);
+
+	for (uint32_t i = 0; i < element->childCount; i += 4) {
+		__m128i l = _mm_load_si128((__m128i *) &CHILD_CLIP_L(element, i)), r = _mm_load_si128((__m128i *) &CHILD_CLIP_R(element, i));
+		__m128i t = _mm_load_si128((__m128i *) &CHILD_CLIP_T(element, i)), b = _mm_load_si128((__m128i *) &CHILD_CLIP_B(element, i));
+		__m128i inside = _mm_and_si128(_mm_andnot_si128(_mm_cmpgt_epi32(l, px), _mm_cmpgt_epi32(r, px)),
+				_mm_andnot_si128(_mm_cmpgt_epi32(t, py), _mm_cmpgt_epi32(b, py)));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+		if (mask) return i + ((mask & 1) ? 0 : (mask & 2) ? 1 : (mask & 4) ? 2 : 3);
+	}
+
+	return element->childCount;
+#else
+	uint32_t i = 0;
+	while (i < element->childCount && !_ChildClipContains(element, i, x, y)) i++;
+	return i;
+#endif
+}
+
+void _ElementPaintContents(Element *element, Painter *painter, Rectangle clip);
+
+void _LayerUnlink(Layer *layer) {
+	if (layer->previous) layer->previous->next = layer->next;
+	else global.layers.first = layer->next;
+	if (layer->next) layer->next->previous = layer->previous;
+	else global.layers.last = layer->previous;
+	layer->previous = layer->next = NULL;
+}
+
+void _LayerFree(Layer *layer) {
+	_LayerUnlink(layer);
+	global.layers.bytes -= _RectangleArea(layer->rectangle) * 4;
+	layer->element->layer = NULL;
+	free(layer->bits);
+	free(layer);
+}
+
+size_t _LayerBudget() {
+	return global.layers.budget ? global.layers.budget : LAYER_CACHE_DEFAULT_BUDGET;
+}
+
+void _LayerEvict() {
+	Layer *layer = global.layers.last;
+
+	while (layer && global.layers.bytes > _LayerBudget()) {
+		Layer *previous = layer->previous;
+		if (!layer->busy) _LayerFree(layer);
+		layer = previous;
+	}
+}
+
+// Marks the part of r inside the layers of element and its ancestors as needing to be painted again.
+void _LayerInvalidate(Element *element, Rectangle r) {
+	for (; element; element = element->parent) {
+		Layer *layer = element->layer;
+		if (!layer) continue;
+		Rectangle dirty = RectangleIntersection(r, layer->rectangle);
+		if (!RectangleValid(dirty)) continue;
+		layer->dirty = RectangleValid(layer->dirty) ? RectangleBounding(layer->dirty, dirty) : dirty;
+	}
+}
+
+// Brings the element's layer up to date, and moves it to the front of the LRU list.
+// Returns NULL if the layer doesn't fit in the budget.
+Layer *_LayerUpdate(Element *element) {
+	Layer *layer = element->layer;
+	size_t bytes = _RectangleArea(element->clip) * 4;
+
+	if (bytes > _LayerBudget()) {
+		if (layer) _LayerFree(layer);
+		global.stats.layerMisses++;
+		return NULL;
+	}
+
+	if (!layer) {
+		layer = element->layer = (Layer *) calloc(1, sizeof(Layer));
+		layer->element = element;
+	} else {
+		_LayerUnlink(layer);
+	}
+
+	if (!layer->bits || !RectangleEquals(layer->rectangle, element->clip)) {
+		global.layers.bytes -= layer->bits ? _RectangleArea(layer->rectangle) * 4 : 0;
+		global.layers.bytes += bytes;
+		free(layer->bits);
+		layer->bits = (uint32_t *) malloc(bytes);
+		layer->rectangle = layer->dirty = element->clip;
+	}
+
+	layer->next = global.layers.first;
+	if (layer->next) layer->next->previous = layer;
+	else global.layers.last = layer;
+	global.layers.first = layer;
+
+	layer->busy = true;
+
+	if (RectangleValid(layer->dirty)) {
+		// Offset the bits so that the subtree can paint with window coordinates.
+		int width = layer->rectangle.r - layer->rectangle.l;
+		Painter painter = { 0 };
+		painter.bits = layer->bits - ((ptrdiff_t) layer->rectangle.t * width + layer->rectangle.l);
+		painter.stride = width;
+		painter.height = layer->rectangle.b;
+		_ElementPaintContents(element, &painter, layer->dirty);
+		layer->dirty = RectangleMake(0, 0, 0, 0);
+		global.stats.layerMisses++;
+	} else {
+		global.stats.layerHits++;
+	}
+
+	_LayerEvict();
+	layer->busy = false;
+	return layer;
+}
+
+void _LayerBlit(Layer *layer, Painter *painter, Rectangle clip) {
+	int width = layer->rectangle.r - layer->rectangle.l;
+
+	for (int y = clip.t; y < clip.b; y++) {
+		memcpy(painter->bits + y * painter->stride + clip.l, 
+				layer->bits + (y - layer->rectangle.t) * width + (clip.l - layer->rectangle.l), 
+				(clip.r - clip.l) * 4);
+	}
+}
+
+// Updates the layers that intersect the region before parallel painting, so the workers only have to blit them.
+void _LayerPrepare(Element *element, Rectangle region) {
+	Rectangle clip = RectangleIntersection(element->clip, region);
+
+	if (!RectangleValid(clip)) {
+		return;
+	}
+
+	if (element->flags & ELEMENT_LAYER_CACHE) {
+		_LayerUpdate(element);
+		return;
+	}
+
+	for (uint32_t group = 0; group < element->childCount; group += 4) {
+		for (uint32_t i = group, mask = _ChildClipsIntersecting(element, group, clip); mask; i++, mask >>= 1) {
+			if (mask & 1) _LayerPrepare(element->children[i], clip);
+		}
+	}
+}
+
+void LayerCacheSetBudget(size_t bytes) {
+	global.layers.budget = bytes;
+	_LayerEvict();
+}
+
+void _ElementPaint(Element *element, Painter *painter) {
+	Rectangle clip = RectangleIntersection(element->clip, painter->clip);
+
+	if (!RectangleValid(clip)) {
+		return;
+	}
+
+	TRACE_BEGIN();
+
+	if (element->flags & ELEMENT_LAYER_CACHE) {
+		// While painting in parallel, the layers were prepared beforehand; fall back to painting directly if one was evicted.
+		Layer *layer = global.parallel.painting ? element->layer : _LayerUpdate(element);
+
+		if (layer && !RectangleValid(layer->dirty) && RectangleEquals(layer->rectangle, element->clip)) {
+			_LayerBlit(layer, painter, clip);
+			TRACE_END("blit layer", element);
+			return;
+		}
+	}
+
+	_ElementPaintContents(element, painter, clip);
+	TRACE_END("paint subtree", element);
+}
+
+// Only the topmost few opaque children are used for occlusion, to bound the cost for elements with many children.
+#define OCCLUSION_MAX_OCCLUDERS (8)
+
+void _ElementPaintContents(Element *element, Painter *painter, Rectangle clip) {
+	// Find the opaque children in the clip, topmost first; they hide the element and the children beneath them.
+	uint32_t occluders[OCCLUSION_MAX_OCCLUDERS];
+	int occluderCount = 0;
+
+	for (uint32_t group = (element->childCount + 3) & ~3; group > 0 && occluderCount < OCCLUSION_MAX_OCCLUDERS; group -= 4) {
+		uint32_t mask = _ChildClipsIntersecting(element, group - 4, clip);
+
+		for (uint32_t i = group; i > group - 4 && occluderCount < OCCLUSION_MAX_OCCLUDERS; i--) {
+			if ((mask & (1 << (i - 1 - (group - 4)))) && (element->children[i - 1]->flags & ELEMENT_OPAQUE)) {
+				occluders[occluderCount++] = i - 1;
+			}
+		}
+	}
+
+	if (_ElementWantsMessage(element, MSG_PAINT)) {
+		Rectangle visible = clip;
+
+		for (int i = 0; i < occluderCount && RectangleValid(visible); i++) {
+			visible = _RectangleSubtract(visible, element->children[occluders[i]]->clip);
+		}
+
+		if (RectangleValid(visible)) {
+			painter->clip = visible;
+			painter->pixelsDrawn += _RectangleArea(visible);
+			ElementMessage(element, MSG_PAINT, 0, painter);
+		}
+	}
+
+	for (uint32_t group = 0; group < element->childCount; group += 4) {
+		for (uint32_t i = group, mask = _ChildClipsIntersecting(element, group, clip); mask; i++, mask >>= 1) {
+			if (~mask & 1) continue;
+			Rectangle visible = clip;
+
+			for (int j = 0; j < occluderCount && occluders[j] > i && RectangleValid(visible); j++) {
+				visible = _RectangleSubtract(visible, element->children[occluders[j]]->clip);
+			}
+
+			painter->clip = visible;
+			if (RectangleValid(visible)) _ElementPaint(element->children[i], painter);
+		}
+	}
+}
+
+// Aim for this many children per grid cell, with cells no smaller than the minimum size.
+#define SPATIAL_CHILDREN_PER_CELL (2)
+#define SPATIAL_MINIMUM_CELL_SIZE (8)
+
+bool _SpatialCellRange(SpatialGrid *grid, Rectangle r, Rectangle *cells) {
+	r = RectangleIntersection(r, grid->area);
+	if (!RectangleValid(r)) return false;
+	cells->l = (r.l - grid->area.l) / grid->cellWidth;
+	cells->r = (r.r - 1 - grid->area.l) / grid->cellWidth + 1;
+	cells->t = (r.t - grid->area.t) / grid->cellHeight;
+	cells->b = (r.b - 1 - grid->area.t) / grid->cellHeight + 1;
+	return true;
+}
+
+void _SpatialInsert(SpatialGrid *grid, Rectangle clip, uint32_t index) {
+	Rectangle range;
+	if (!_SpatialCellRange(grid, clip, &range)) return;
+
+	for (int y = range.t; y < range.b; y++) {
+		for (int x = range.l; x < range.r; x++) {
+			SpatialCell *cell = &grid->cells[y * grid->columns + x];
+
+			if (cell->count == cell->capacity) {
+				cell->capacity = cell->capacity ? cell->capacity * 2 : 4;
+				cell->children = (uint32_t *) realloc(cell->children, cell->capacity * sizeof(uint32_t));
+			}
+
+			// Children are usually inserted in order, so search from the end.
+			uint32_t position = cell->count;
+			while (position && cell->children[position - 1] > index) position--;
+			memmove(cell->children + position + 1, cell->children + position, (cell->count - position) * sizeof(uint32_t));
+			cell->children[position] = index;
+			cell->count++;
+		}
+	}
+}
+
+void _SpatialRemove(SpatialGrid *grid, Rectangle clip, uint32_t index) {
+	Rectangle range;
+	if (!_SpatialCellRange(grid, clip, &range)) return;
+
+	for (int y = range.t; y < range.b; y++) {
+		for (int x = range.l; x < range.r; x++) {
+			SpatialCell *cell = &grid->cells[y * grid->columns + x];
+
+			for (uint32_t i = 0; i < cell->count; i++) {
+				if (cell->children[i] == index) {
+					memmove(cell->children + i, cell->children + i + 1, (cell->count - i - 1) * sizeof(uint32_t));
+					cell->count--;
+					break;
+				}
+			}
+		}
+	}
+}
+
+void _SpatialBuild(Element *element) {
+	SpatialGrid *grid = element->grid;
+
+	for (int i = 0; i < grid->columns * grid->rows; i++) {
+		free(grid->cells[i].children);
+	}
+
+	free(grid->cells);
+	grid->area = element->clip;
+	grid->dirty = false;
+
+	int width = grid->area.r - grid->area.l, height = grid->area.b - grid->area.t;
+	if (width < 1) width = 1;
+	if (height < 1) height = 1;
+
+	// Choose square cells, so that there are about SPATIAL_CHILDREN_PER_CELL children per cell.
+	int64_t cellArea = (int64_t) width * height * SPATIAL_CHILDREN_PER_CELL / (element->childCount + 1);
+	int cellSize = SPATIAL_MINIMUM_CELL_SIZE;
+	while ((int64_t) cellSize * cellSize < cellArea) cellSize++;
+	grid->cellWidth = grid->cellHeight = cellSize;
+	grid->columns = (width + cellSize - 1) / cellSize;
+	grid->rows = (height + cellSize - 1) / cellSize;
+	grid->cells = (SpatialCell *) calloc(grid->columns * grid->rows, sizeof(SpatialCell));
+
+	for (uint32_t i = 0; i < element->childCount; i++) {
+		_SpatialInsert(grid, RectangleMake(CHILD_CLIP_L(element, i), CHILD_CLIP_R(element, i), CHILD_CLIP_T(element, i), CHILD_CLIP_B(element, i)), i);
+	}
+}
+
+void _SpatialFree(SpatialGrid *grid) {
+	if (!grid) return;
+
+	for (int i = 0; i < grid->columns * grid->rows; i++) {
+		free(grid->cells[i].children);
+	}
+
+	free(grid->cells);
+	free(grid);
+}
+
+// Called when a child's clip changes, to keep its parent's index up to date.
+void _SpatialChildMoved(Element *child, Rectangle oldClip) {
+	SpatialGrid *grid = child->parent->grid;
+
+	if (grid && !grid->dirty) {
+		_SpatialRemove(grid, oldClip, child->index);
+		_SpatialInsert(grid, child->clip, child->index);
+	}
+}
+
+Element *_SpatialFind(Element *element, int x, int y) {
+	if (!element->grid) {
+		element->grid = (SpatialGrid *) calloc(1, sizeof(SpatialGrid));
+		element->grid->dirty = true;
+	}
+
+	SpatialGrid *grid = element->grid;
+	if (grid->dirty) _SpatialBuild(element);
+	if (!RectangleContains(grid->area, x, y)) return NULL;
+
+	SpatialCell *cell = &grid->cells[(y - grid->area.t) / grid->cellHeight * grid->columns + (x - grid->area.l) / grid->cellWidth];
+
+	for (uint32_t i = 0; i < cell->count; i++) {
+		if (_ChildClipContains(element, cell->children[i], x, y)) {
+			return element->children[cell->children[i]];
+		}
+	}
+
+	return NULL;
+}
+
+Element *ElementFindByPoint(Element *element, int x, int y) {
+	if (element->flags & ELEMENT_SPATIAL_INDEX) {
+		Element *child = _SpatialFind(element, x, y);
+		return child ? ElementFindByPoint(child, x, y) : element;
+	}
+
+	uint32_t i = _ChildClipsFind(element, x, y);
+	return i < element->childCount ? ElementFindByPoint(element->children[i], x, y) : element;
+}
+
+void _ElementLayoutNow(Element *element) {
+	TRACE_BEGIN();
+	element->flags &= ~ELEMENT_NEEDS_LAYOUT;
+	global.stats.layoutMessages++;
+	ElementMessage(element, MSG_LAYOUT, 0, 0);
+	TRACE_END("layout subtree", element);
+}
+
+void _ElementLayout(Element *element) {
+	if (element->flags & ELEMENT_NEEDS_LAYOUT) {
+		_ElementLayoutNow(element);
+	}
+
+	if (element->flags & ELEMENT_DESCENDANT_NEEDS_LAYOUT) {
+		element->flags &= ~ELEMENT_DESCENDANT_NEEDS_LAYOUT;
+
+		for (uintptr_t i = 0; i < element->childCount; i++) {
+			if (element->children[i]->flags & (ELEMENT_NEEDS_LAYOUT | ELEMENT_DESCENDANT_NEEDS_LAYOUT)) {
+				_ElementLayout(element->children[i]);
+			}
+		}
+	}
+}
+
+// Lays out the elements marked since the last pass, top down, so each one is laid out at most once.
+// Moves made by MSG_LAYOUT handlers during the pass take effect immediately, as the parent has settled by then.
+void _WindowLayout(Window *window) {
+	if (!(window->e.flags & (ELEMENT_NEEDS_LAYOUT | ELEMENT_DESCENDANT_NEEDS_LAYOUT))) {
+		return;
+	}
+
+	TRACE_BEGIN();
+	global.layingOut = true;
+	_ElementLayout(&window->e);
+	global.layingOut = false;
+	global.stats.layoutPasses++;
+	TRACE_END("layout pass", window);
+}
+
+// Paints and presents the window's damage, which must be laid out already. Returns the number of pixels painted.
+uint64_t _WindowUpdate(Window *window, uint64_t *pixelsDrawn) {
+	Painter painter = { 0 };
+	painter.bits = window->bits;
+	painter.stride = window->stride;
+	painter.height = window->height;
+	_WindowBeginPaint(window);
+	uint64_t pixels = 0;
+
+	for (int j = 0; j < window->updateRegion.count; j++) {
+		Rectangle *r = &window->updateRegion.rectangles[j];
+		*r = RectangleIntersection(RectangleMake(0, window->width, 0, window->height), *r);
+
+		if (!RectangleValid(*r)) {
+			_DamageRemove(&window->updateRegion, j--);
+			continue;
+		}
+
+		pixels += _RectangleArea(*r);
+	}
+
+	if (global.parallel.threadCount > 1 && pixels >= PARALLEL_MINIMUM_PIXELS) {
+		_ParallelPaint(window);
+		painter.pixelsDrawn = global.parallel.pixelsDrawn;
+	} else {
+		for (int j = 0; j < window->updateRegion.count; j++) {
+			painter.clip = window->updateRegion.rectangles[j];
+			_ElementPaint(&window->e, &painter);
+		}
+	}
+
+	*pixelsDrawn += painter.pixelsDrawn;
+
+	if (global.present.bufferCount > 1) {
+		// Hand the frame to the present thread, and carry on with the next one.
+		TRACE_BEGIN();
+		_PresentQueue(window);
+		TRACE_END("queue present", window);
+	} else {
+		TRACE_BEGIN();
+		_WindowEndPaint(window, &painter);
+		TRACE_END("present", window);
+
+		if (window->inputTime) {
+			_InputLatency(_TimeMicroseconds() - window->inputTime);
+			window->inputTime = 0;
+		}
+	}
+
+	window->updateRegion.count = 0;
+	return pixels;
+}
+
+void _Update() {
+	uint64_t pixels = 0, pixelsDrawn = 0;
+	TRACE_BEGIN();
+	global.stats.layoutMessages = 0;
+
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		_WindowLayout(global.windows[i]);
+	}
+
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		Window *window = global.windows[i];
+
+		if (window->updateRegion.count) {
+			pixels += _WindowUpdate(window, &pixelsDrawn);
+		} else {
+			// The input didn't change anything, so there's nothing to measure the latency to.
+			window->inputTime = 0;
+		}
+	}
+
+	if (pixels) {
+		TRACE_END("frame", NULL);
+#ifdef TOY_TRACE
+		_TraceFrame(_traceStart);
+#endif
+		global.stats.frames++;
+		global.stats.pixelsPainted = pixels;
+		global.stats.pixelsDrawn = pixelsDrawn;
+		global.stats.pixelsPaintedTotal += pixels;
+	}
+}
+
+// Called by _WindowExpose before it presents the region again, which would otherwise show bits that haven't been painted yet.
+// After a resize, the exposed strips are exactly the damage that's waiting for the next frame, so it's painted now instead.
+void _WindowExposePaint(Window *window, DamageRegion *region) {
+	_WindowLayout(window);
+
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		for (int j = 0; j < region->count; j++) {
+			if (RectangleValid(RectangleIntersection(window->updateRegion.rectangles[i], region->rectangles[j]))) {
+				uint64_t pixelsDrawn = 0;
+				global.stats.pixelsPaintedTotal += _WindowUpdate(window, &pixelsDrawn);
+				return;
+			}
+		}
+	}
+}
+
+bool _UpdatePending() {
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		if (global.windows[i]->updateRegion.count || (global.windows[i]->e.flags & (ELEMENT_NEEDS_LAYOUT | ELEMENT_DESCENDANT_NEEDS_LAYOUT))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void _WindowInputEvent(Window *window, Message message, int di, void *dp) {
+	if (!window->inputTime) window->inputTime = _InputArrivalTime();
+	if (message == MSG_MOUSE_MOVE) _InputRecord(window, INPUT_RECORD_MOVE, window->cursorX, window->cursorY);
+
+	// Hit-test against the current layout.
+	_WindowLayout(window);
+	Element *hovered = ElementFindByPoint(&window->e, window->cursorX, window->cursorY);
+
+	if (message == MSG_MOUSE_MOVE) {
+		ElementMessage(hovered, MSG_MOUSE_MOVE, di, dp);
+	}
+
+	if (hovered != window->hovered) {
+		Element *previous = window->hovered;
+		window->hovered = hovered;
+		ElementMessage(previous, MSG_UPDATE, UPDATE_HOVERED, 0);
+		ElementMessage(window->hovered, MSG_UPDATE, UPDATE_HOVERED, 0);
+	}
+}
+
+void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout) {
+	Rectangle oldClip = element->clip;
+	element->clip = RectangleIntersection(element->parent->clip, bounds);
+
+	if (!RectangleEquals(element->clip, oldClip)) {
+		_ChildClipsSet(element->parent, element->index, element->clip);
+		_SpatialChildMoved(element, oldClip);
+		if (element->grid) element->grid->dirty = true;
+	}
+
+	if (!RectangleEquals(element->bounds, bounds) || !RectangleEquals(element->clip, oldClip)) {
+		_LayerInvalidate(element, oldClip);
+		_LayerInvalidate(element, element->clip);
+	}
+
+	if (!RectangleEquals(element->bounds, bounds) || !RectangleEquals(element->clip, oldClip) || alwaysLayout) {
+		element->bounds = bounds;
+		ElementRelayout(element);
+	}
+}
+
+void ElementRelayout(Element *element) {
+	if (global.layingOut || !element->window) {
+		// There's no later pass to wait for.
+		_ElementLayoutNow(element);
+		return;
+	}
+
+	element->flags |= ELEMENT_NEEDS_LAYOUT;
+
+	// Once an ancestor is marked, so are all of its ancestors.
+	for (Element *ancestor = element->parent; ancestor && !(ancestor->flags & ELEMENT_DESCENDANT_NEEDS_LAYOUT); ancestor = ancestor->parent) {
+		ancestor->flags |= ELEMENT_DESCENDANT_NEEDS_LAYOUT;
+	}
+}
+
+void ElementRepaint(Element *element, Rectangle *region) {
+	if (!region) {
+		region = &element->bounds;
+	}
+
+	Rectangle r = RectangleIntersection(*region, element->clip);
+	_LayerInvalidate(element, r);
+	DamageAdd(&element->window->updateRegion, r);
+}
+
+// The window's pixels inside the viewport can only be moved if they were painted by the element and its first few children.
+// Later children and siblings would be painted over it, and a layer would keep a copy that didn't move.
+bool _ElementScrollable(Element *element, Rectangle viewport, uint32_t scrolledChildren) {
+	for (uint32_t i = scrolledChildren; i < element->childCount; i++) {
+		if (_ChildClipIntersects(element, i, viewport)) {
+			return false;
+		}
+	}
+
+	for (Element *ancestor = element; ancestor; ancestor = ancestor->parent) {
+		if (ancestor->layer) {
+			return false;
+		}
+
+		for (uint32_t i = ancestor->index + 1; ancestor->parent && i < ancestor->parent->childCount; i++) {
+			if (_ChildClipIntersects(ancestor->parent, i, viewport)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Moves the pixels inside the element's clip by (dx, dy), with the damage pending there. Only the strips uncovered by the move are repainted.
+// The caller then moves its contents and first scrolledChildren children by the same amount, so that anything they repaint while moving isn't shifted again.
+void _ElementScroll(Element *element, int dx, int dy, uint32_t scrolledChildren) {
+	Window *window = element->window;
+	Rectangle viewport = RectangleIntersection(element->clip, RectangleMake(0, window->width, 0, window->height));
+	Rectangle destination = RectangleIntersection(viewport, RectangleMake(viewport.l + dx, viewport.r + dx, viewport.t + dy, viewport.b + dy));
+
+	if (!RectangleValid(viewport)) {
+		return;
+	}
+
+	if (!RectangleValid(destination) || !_ElementScrollable(element, viewport, scrolledChildren)) {
+		ElementRepaint(element, &viewport);
+		return;
+	}
+
+	// Pending damage moves along with the stale pixels it covers.
+	Rectangle moved[DAMAGE_MAX_RECTANGLES];
+	int movedCount = 0;
+
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		Rectangle r = RectangleIntersection(window->updateRegion.rectangles[i], viewport);
+		if (!RectangleValid(r)) continue;
+		moved[movedCount++] = RectangleIntersection(RectangleMake(r.l + dx, r.r + dx, r.t + dy, r.b + dy), viewport);
+	}
+
+	// Wait for the platform to finish reading the bits from the last frame.
+	_WindowBeginPaint(window);
+
+	// Copy rows in the opposite order to the move, so that each source row is read before it is overwritten.
+	int width = destination.r - destination.l, stride = window->stride;
+
+	for (int i = 0; i < destination.b - destination.t; i++) {
+		int y = dy > 0 ? destination.b - 1 - i : destination.t + i;
+		uint32_t *row = window->bits + (size_t) y * stride + destination.l;
+		memmove(row, row - (ptrdiff_t) dy * stride - dx, width * 4);
+	}
+
+	// The platform's copy has to be moved after any frames still waiting to be presented.
+	_PresentFlush();
+	_WindowScroll(window, destination, dx, dy);
+	global.stats.pixelsScrolled += _RectangleArea(destination);
+
+	for (int i = 0; i < movedCount; i++) {
+		DamageAdd(&window->updateRegion, moved[i]);
+	}
+
+	if (dy) {
+		Rectangle strip = dy > 0 ? RectangleMake(viewport.l, viewport.r, viewport.t, destination.t)
+			: RectangleMake(viewport.l, viewport.r, destination.b, viewport.b);
+		ElementRepaint(element, &strip);
+	}
+
+	if (dx) {
+		Rectangle strip = dx > 0 ? RectangleMake(viewport.l, destination.l, destination.t, destination.b)
+			: RectangleMake(destination.r, viewport.r, destination.t, destination.b);
+		ElementRepaint(element, &strip);
+	}
+}
+
+int ElementMessage(Element *element, Message message, int di, void *dp) {
+	uint32_t bit = MESSAGE_BIT(message);
+	bool user = element->messageUser && (element->userMessages & bit);
+	bool cls = element->messageClass && (element->classMessages & bit);
+
+	if (!user && !cls) {
+		return 0;
+	}
+
+	TRACE_BEGIN();
+	int result = 0;
+
+	if (user) {
+		result = element->messageUser(element, message, di, dp);
+	}
+
+	if (!result && cls) {
+		result = element->messageClass(element, message, di, dp);
+	}
+
+	TRACE_END(_traceMessageNames[message < MSG_USER ? message : MSG_USER], element);
+	return result;
+}
+
+void *_PoolAllocate(ElementPool *pool, size_t bytes) {
+	size_t sizeClass = (bytes + POOL_GRANULARITY - 1) / POOL_GRANULARITY - 1;
+	size_t size = (sizeClass + 1) * POOL_GRANULARITY;
+	void *allocation = pool->freeLists[sizeClass];
+
+	if (allocation) {
+		pool->freeLists[sizeClass] = *(void **) allocation;
+	} else {
+		if (!pool->slabs || pool->slabs->used + size > POOL_SLAB_BYTES) {
+			PoolSlab *slab = (PoolSlab *) malloc(POOL_SLAB_BYTES);
+			slab->next = pool->slabs;
+			slab->used = (sizeof(PoolSlab) + POOL_GRANULARITY - 1) / POOL_GRANULARITY * POOL_GRANULARITY;
+			pool->slabs = slab;
+		}
+
+		allocation = (uint8_t *) pool->slabs + pool->slabs->used;
+		pool->slabs->used += size;
+	}
+
+	memset(allocation, 0, size);
+	return allocation;
+}
+
+void _PoolFree(ElementPool *pool, void *allocation, size_t bytes) {
+	size_t sizeClass = (bytes + POOL_GRANULARITY - 1) / POOL_GRANULARITY - 1;
+	*(void **) allocation = pool->freeLists[sizeClass];
+	pool->freeLists[sizeClass] = allocation;
+}
+
+// Frees every slab at once; all the elements allocated from the pool must be dead.
+void _PoolRelease(ElementPool *pool) {
+	for (PoolSlab *slab = pool->slabs, *next; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+
+	memset(pool, 0, sizeof(ElementPool));
+}
+
+void _ElementFree(Element *element) {
+	ElementMessage(element, MSG_DESTROY, 0, 0);
+
+	for (uintptr_t i = 0; i < element->childCount; i++) {
+		_ElementFree(element->children[i]);
+	}
+
+	free(element->children);
+	free(element->childClips);
+	_SpatialFree(element->grid);
+	if (element->layer) _LayerFree(element->layer);
+	_MessageQueueForget(element);
+
+	if (element->flags & ELEMENT_POOLED) {
+		_PoolFree(&element->window->pool, element, element->bytes);
+	} else {
+		free(element);
+	}
+}
+
+void ElementDestroy(Element *element) {
+	Element *parent = element->parent;
+
+	if (element->window) {
+		ElementRepaint(element, NULL);
+
+		// Don't leave the window pointing into the subtree.
+		for (Element *ancestor = element->window->hovered; ancestor; ancestor = ancestor->parent) {
+			if (ancestor == element) {
+				element->window->hovered = &element->window->e;
+				break;
+			}
+		}
+	}
+
+	if (parent) {
+		parent->childCount--;
+		memmove(parent->children + element->index, parent->children + element->index + 1, 
+				(parent->childCount - element->index) * sizeof(Element *));
+		_ChildClipsRemove(parent, element->index);
+
+		for (uint32_t i = element->index; i < parent->childCount; i++) {
+			parent->children[i]->index = i;
+		}
+
+		if (parent->grid) parent->grid->dirty = true;
+	}
+
+	_ElementFree(element);
+}
+
+Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass)  {
+	Element *element;
+
+	if (parent && parent->window && bytes <= POOL_CLASSES * POOL_GRANULARITY) {
+		element = (Element *) _PoolAllocate(&parent->window->pool, bytes);
+		flags |= ELEMENT_POOLED;
+	} else {
+		element = (Element *) calloc(1, bytes);
+		flags &= ~ELEMENT_POOLED;
+	}
+
 	element->flags = flags;
+	element->bytes = (uint32_t) bytes;
 	element->messageClass = messageClass;
+	element->classMessages = element->userMessages = MESSAGE_MASK_ALL;
+
+	if (parent) {
+		element->window = parent->window;
+		element->parent = parent;
+		element->index = parent->childCount;
+
+		if (parent->childCount == parent->childCapacity) {
+			uint32_t capacity = parent->childCapacity ? parent->childCapacity * 2 : 4;
+			_ChildClipsGrow(parent, capacity);
+			parent->childCapacity = capacity;
+			parent->children = (Element **) realloc(parent->children, sizeof(Element *) * parent->childCapacity);
+		}
+
+		parent->children[parent->childCount++] = element;
+		if (parent->grid) parent->grid->dirty = true;
+	}
+
+	return element;
+}
+
+size_t _WindowMapHash(WindowMap *map, uintptr_t handle) {
+	return (size_t) (((uint64_t) handle * 0x9E3779B97F4A7C15) >> 32) & (map->capacity - 1);
+}
+
+Window *_WindowMapFind(WindowMap *map, uintptr_t handle) {
+	if (!map->capacity) return NULL;
+
+	for (size_t i = _WindowMapHash(map, handle); map->slots[i].handle; i = (i + 1) & (map->capacity - 1)) {
+		if (map->slots[i].handle == handle) {
+			return map->slots[i].window;
+		}
+	}
+
+	return NULL;
+}
+
+void _WindowMapInsert(WindowMap *map, uintptr_t handle, Window *window) {
+	if ((map->count + 1) * 2 > map->capacity) {
+		// Keep the load factor under a half, so probe sequences stay short.
+		WindowMap old = *map;
+		map->capacity = old.capacity ? old.capacity * 2 : 16;
+		map->slots = (WindowMapSlot *) calloc(map->capacity, sizeof(WindowMapSlot));
+		map->count = 0;
+
+		for (size_t i = 0; i < old.capacity; i++) {
+			if (old.slots[i].handle) {
+				_WindowMapInsert(map, old.slots[i].handle, old.slots[i].window);
+			}
+		}
+
+		free(old.slots);
+	}
+
+	size_t i = _WindowMapHash(map, handle);
+	while (map->slots[i].handle && map->slots[i].handle != handle) i = (i + 1) & (map->capacity - 1);
+	if (!map->slots[i].handle) map->count++;
+	map->slots[i].handle = handle;
+	map->slots[i].window = window;
+}
+
+void _WindowMapRemove(WindowMap *map, uintptr_t handle) {
+	if (!map->capacity) return;
+	size_t mask = map->capacity - 1, i = _WindowMapHash(map, handle);
+
+	while (map->slots[i].handle != handle) {
+		if (!map->slots[i].handle) return;
+		i = (i + 1) & mask;
+	}
+
+	// Shift back the following entries that would no longer be reachable across the gap.
+	for (size_t j = (i + 1) & mask; map->slots[j].handle; j = (j + 1) & mask) {
+		size_t home = _WindowMapHash(map, map->slots[j].handle);
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+
+	map->slots[i].handle = 0;
+	map->slots[i].window = NULL;
+	map->count--;
+}
+
+void _WindowAdd(Window *window) {
+	window->hovered = &window->e;
+	window->e.window = window;
+
+	if (global.windowCount == global.windowCapacity) {
+		global.windowCapacity = global.windowCapacity ? global.windowCapacity * 2 : 4;
+		global.windows = (Window **) realloc(global.windows, sizeof(Window *) * global.windowCapacity);
+	}
+
+	global.windows[global.windowCount++] = window;
+	window->ordinal = global.windowsCreated++;
+	_WindowMapInsert(&global.windowOrdinals, (uintptr_t) window->ordinal + 1, window);
+}
+
+// Frees the element tree and the window, after the platform has released its resources.
+void _WindowFree(Window *window) {
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		if (global.windows[i] == window) {
+			global.windows[i] = global.windows[--global.windowCount];
+			break;
+		}
+	}
+
+	_WindowMapRemove(&global.windowOrdinals, (uintptr_t) window->ordinal + 1);
+
+	ElementMessage(&window->e, MSG_DESTROY, 0, 0);
+
+	for (uintptr_t i = 0; i < window->e.childCount; i++) {
+		_ElementFree(window->e.children[i]);
+	}
+
+	_MessageQueueForget(&window->e);
+
+	// All the pooled elements are dead now, so release the slabs in one go.
+	_PoolRelease(&window->pool);
+	free(window->e.children);
+	free(window->e.childClips);
+	_SpatialFree(window->e.grid);
+	free(window);
+}
+
+// Works out whether the framebuffer has to be reallocated to hold width by height pixels, and if so, its new stride and row count.
+bool _FramebufferNeedsResize(Window *window, int width, int height, int *stride, int *rows) {
+	size_t needed = (size_t) width * height;
+
+	if (width <= window->stride && (size_t) height * window->stride <= window->capacity 
+			&& (needed * FRAMEBUFFER_SLACK >= window->capacity || !needed)) {
+		return false;
+	}
+
+	// Rows start on a cache line.
+	*stride = (width + width / FRAMEBUFFER_SLACK + 15) & ~15;
+	*rows = height + height / FRAMEBUFFER_SLACK;
+	return true;
+}
+
+// Copies the pixels that are in the window both before and after a resize to the new framebuffer, so they needn't be painted again.
+void _FramebufferCopy(Window *window, uint32_t *bits, int stride, int width, int height) {
+	int copyWidth = width < window->width ? width : window->width;
+	int copyHeight = height < window->height ? height : window->height;
+
+	for (int y = 0; y < copyHeight; y++) {
+		memcpy(bits + (size_t) y * stride, window->bits + (size_t) y * window->stride, copyWidth * 4);
+	}
+}
+
+// Pixels outside the window aren't kept up to date, so once a resize cuts them off, they have to be painted again if it grows back.
+// This holds even if several resizes happen before the next layout.
+void _FramebufferSetSize(Window *window, int width, int height) {
+	window->width = width;
+	window->height = height;
+	if (window->laidOutWidth > width) window->laidOutWidth = width;
+	if (window->laidOutHeight > height) window->laidOutHeight = height;
+}
+
+// For platforms where the framebuffer is plain memory.
+void _WindowResizeBits(Window *window, int width, int height) {
+	int stride, rows;
+
+	if (_FramebufferNeedsResize(window, width, height, &stride, &rows)) {
+		uint32_t *bits = (uint32_t *) calloc((size_t) stride * rows, 4);
+		_FramebufferCopy(window, bits, stride, width, height);
+		free(window->bits);
+		window->bits = bits;
+		window->stride = stride;
+		window->capacity = (size_t) stride * rows;
+	}
+
+	_FramebufferSetSize(window, width, height);
+}
+
+// Called by the window's MSG_LAYOUT, after its first child has been moved.
+// The pixels are kept across a resize, so content marked ELEMENT_RESIZE_KEEPS_PIXELS only needs the strips the resize exposed painted.
+void _WindowRepaintAfterLayout(Window *window) {
+	if (window->e.children[0]->flags & ELEMENT_RESIZE_KEEPS_PIXELS) {
+		Rectangle right = RectangleMake(window->laidOutWidth, window->width, 0, window->height);
+		// The corner is part of the strip on the right.
+		int belowWidth = window->width < window->laidOutWidth ? window->width : window->laidOutWidth;
+		Rectangle below = RectangleMake(0, belowWidth, window->laidOutHeight, window->height);
+		if (RectangleValid(right)) ElementRepaint(&window->e, &right);
+		if (RectangleValid(below)) ElementRepaint(&window->e, &below);
+	} else {
+		ElementRepaint(&window->e, NULL);
+	}
+
+	window->laidOutWidth = window->width;
+	window->laidOutHeight = window->height;
+}
+
+/////////////////////////////////////////
+// Scroll panel.
+/////////////////////////////////////////
+
+void _ScrollPanelClamp(ScrollPanel *panel) {
+	int maximumX = panel->contentWidth - (panel->e.bounds.r - panel->e.bounds.l);
+	int maximumY = panel->contentHeight - (panel->e.bounds.b - panel->e.bounds.t);
+	if (panel->scrollX > maximumX) panel->scrollX = maximumX;
+	if (panel->scrollY > maximumY) panel->scrollY = maximumY;
+	if (panel->scrollX < 0) panel->scrollX = 0;
+	if (panel->scrollY < 0) panel->scrollY = 0;
+}
+
+void _ScrollPanelMoveContent(ScrollPanel *panel) {
+	if (!panel->e.childCount) {
+		return;
+	}
+
+	int x = panel->e.bounds.l - panel->scrollX, y = panel->e.bounds.t - panel->scrollY;
+	ElementMove(panel->e.children[0], RectangleMake(x, x + panel->contentWidth, y, y + panel->contentHeight), false);
+}
+
+int _ScrollPanelMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	ScrollPanel *panel = (ScrollPanel *) element;
+
+	if (message == MSG_PAINT) {
+		DrawBlock((Painter *) dp, element->bounds, panel->background);
+	} else if (message == MSG_LAYOUT) {
+		_ScrollPanelClamp(panel);
+		_ScrollPanelMoveContent(panel);
+	}
+
+	return 0;
+}
+
+ScrollPanel *ScrollPanelCreate(Element *parent, uint32_t flags, uint32_t background) {
+	ScrollPanel *panel = (ScrollPanel *) ElementCreate(sizeof(ScrollPanel), parent, flags | ELEMENT_OPAQUE, _ScrollPanelMessage);
+	panel->e.classMessages = MESSAGE_BIT(MSG_PAINT) | MESSAGE_BIT(MSG_LAYOUT);
+	panel->background = background;
+	return panel;
+}
+
+void ScrollPanelSetContentSize(ScrollPanel *panel, int width, int height) {
+	panel->contentWidth = width;
+	panel->contentHeight = height;
+	ElementRelayout(&panel->e);
+	ElementRepaint(&panel->e, NULL);
+}
+
+void ScrollPanelScrollTo(ScrollPanel *panel, int x, int y) {
+	int oldX = panel->scrollX, oldY = panel->scrollY;
+	panel->scrollX = x, panel->scrollY = y;
+	_ScrollPanelClamp(panel);
+
+	if (panel->scrollX == oldX && panel->scrollY == oldY) {
+		return;
+	}
+
+	_ElementScroll(&panel->e, oldX - panel->scrollX, oldY - panel->scrollY, 1);
+
+	// Lay the content out now rather than in the next pass, so that repaints before then go to where it has moved.
+	// The pending damage has already been shifted, so repaints made by its layout handlers stay where they are.
+	bool layingOut = global.layingOut;
+	global.layingOut = true;
+	_ScrollPanelMoveContent(panel);
+	global.layingOut = layingOut;
+}
+
+/////////////////////////////////////////
+// Virtual list.
+/////////////////////////////////////////
+
+// Painting, hit-testing and scrolling work out the rows from the scroll offset, so their cost doesn't depend on the row count.
+
+void _VirtualListClamp(VirtualList *list) {
+	uint64_t height = list->rowCount * list->rowHeight, visible = list->e.bounds.b - list->e.bounds.t;
+	uint64_t maximum = height > visible ? height - visible : 0;
+	if (list->scroll > maximum) list->scroll = maximum;
+}
+
+int64_t VirtualListRowAt(VirtualList *list, int x, int y) {
+	if (!RectangleContains(list->e.clip, x, y)) {
+		return -1;
+	}
+
+	uint64_t row = (list->scroll + (y - list->e.bounds.t)) / list->rowHeight;
+	return row < list->rowCount ? (int64_t) row : -1;
+}
+
+void VirtualListRepaintRow(VirtualList *list, uint64_t row) {
+	int64_t top = (int64_t) (row * list->rowHeight - list->scroll) + list->e.bounds.t;
+
+	if (row < list->rowCount && top < list->e.clip.b && top + list->rowHeight > list->e.clip.t) {
+		Rectangle r = RectangleMake(list->e.bounds.l, list->e.bounds.r, (int) top, (int) top + list->rowHeight);
+		ElementRepaint(&list->e, &r);
+	}
+}
+
+void _VirtualListUpdateHover(VirtualList *list) {
+	Window *window = list->e.window;
+	int64_t row = window->hovered == &list->e ? VirtualListRowAt(list, window->cursorX, window->cursorY) : -1;
+
+	if (row != list->hoveredRow) {
+		if (list->hoveredRow != -1) VirtualListRepaintRow(list, list->hoveredRow);
+		list->hoveredRow = row;
+		if (row != -1) VirtualListRepaintRow(list, row);
+	}
+}
+
+void _VirtualListPaint(VirtualList *list, Painter *painter) {
+	Rectangle bounds = list->e.bounds, clip = painter->clip;
+	uint64_t offset = list->scroll + (clip.t - bounds.t);
+	uint64_t row = offset / list->rowHeight;
+	int top = clip.t - (int) (offset % list->rowHeight);
+
+	for (; top < clip.b && row < list->rowCount; row++, top += list->rowHeight) {
+		list->paintRow(list, painter, RectangleMake(bounds.l, bounds.r, top, top + list->rowHeight), row);
+	}
+
+	if (top < clip.b) {
+		DrawBlock(painter, RectangleMake(bounds.l, bounds.r, top, bounds.b), list->background);
+	}
+}
+
+int _VirtualListMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	VirtualList *list = (VirtualList *) element;
+
+	if (message == MSG_PAINT) {
+		_VirtualListPaint(list, (Painter *) dp);
+	} else if (message == MSG_LAYOUT) {
+		_VirtualListClamp(list);
+	} else if (message == MSG_MOUSE_MOVE || message == MSG_UPDATE) {
+		_VirtualListUpdateHover(list);
+	}
+
+	return 0;
+}
+
+VirtualList *VirtualListCreate(Element *parent, uint32_t flags, int rowHeight, VirtualListPaintRow paintRow, uint32_t background) {
+	VirtualList *list = (VirtualList *) ElementCreate(sizeof(VirtualList), parent, flags | ELEMENT_OPAQUE, _VirtualListMessage);
+	list->e.classMessages = MESSAGE_BIT(MSG_PAINT) | MESSAGE_BIT(MSG_LAYOUT) | MESSAGE_BIT(MSG_MOUSE_MOVE) | MESSAGE_BIT(MSG_UPDATE);
+	list->rowHeight = rowHeight < 1 ? 1 : rowHeight; // Rows are found by dividing by the height.
+	list->paintRow = paintRow;
+	list->background = background;
+	list->hoveredRow = -1;
+	return list;
+}
+
+void VirtualListSetRowCount(VirtualList *list, uint64_t rowCount) {
+	list->rowCount = rowCount;
+	_VirtualListClamp(list);
+	ElementRepaint(&list->e, NULL);
+	_VirtualListUpdateHover(list);
+}
+
+void VirtualListScrollTo(VirtualList *list, uint64_t scroll) {
+	uint64_t oldScroll = list->scroll;
+	list->scroll = scroll;
+	_VirtualListClamp(list);
+
+	if (list->scroll == oldScroll) {
+		return;
+	}
+
+	// Anything further than the height of the list repaints all of it.
+	int height = list->e.bounds.b - list->e.bounds.t;
+	int64_t dy = (int64_t) (oldScroll - list->scroll);
+	if (dy > height) dy = height;
+	if (dy < -height) dy = -height;
+	_ElementScroll(&list->e, 0, (int) dy, 0);
+	_VirtualListUpdateHover(list);
+}
+
+/////////////////////////////////////////
+// Image display.
+/////////////////////////////////////////
+
+// Keeps the scaled copy in step with the element's size. Only called outside painting, since paint handlers may run in parallel.
+void _ImageDisplayScale(ImageDisplay *display) {
+	int width = display->e.bounds.r - display->e.bounds.l, height = display->e.bounds.b - display->e.bounds.t;
+
+	if (!display->bits || width <= 0 || height <= 0 || (width == display->width && height == display->height)
+			|| (int64_t) width * height > IMAGE_DISPLAY_MAX_SCALED_PIXELS) {
+		free(display->scaled);
+		display->scaled = NULL;
+		return;
+	}
+
+	if (display->scaled && display->scaledWidth == width && display->scaledHeight == height) {
+		return;
+	}
+
+	free(display->scaled);
+	display->scaled = (uint32_t *) malloc((size_t) width * height * 4);
+	display->scaledWidth = width, display->scaledHeight = height;
+	Painter painter = { 0 };
+	painter.clip = RectangleMake(0, width, 0, height);
+	painter.bits = display->scaled;
+	painter.stride = width;
+	painter.height = height;
+	DrawImage(&painter, painter.clip, display->bits, display->width, display->height, display->stride, display->filter);
+}
+
+int _ImageDisplayMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	ImageDisplay *display = (ImageDisplay *) element;
+
+	if (message == MSG_PAINT) {
+		Painter *painter = (Painter *) dp;
+
+		if (!display->bits) {
+			DrawBlock(painter, element->bounds, 0xFF000000);
+		} else if (display->scaled && display->scaledWidth == element->bounds.r - element->bounds.l 
+				&& display->scaledHeight == element->bounds.b - element->bounds.t) {
+			DrawImage(painter, element->bounds, display->scaled, display->scaledWidth, display->scaledHeight, display->scaledWidth, IMAGE_NEAREST);
+		} else {
+			DrawImage(painter, element->bounds, display->bits, display->width, display->height, display->stride, display->filter);
+		}
+	} else if (message == MSG_LAYOUT) {
+		_ImageDisplayScale(display);
+	} else if (message == MSG_DESTROY) {
+		free(display->scaled);
+	}
+
+	return 0;
+}
+
+ImageDisplay *ImageDisplayCreate(Element *parent, uint32_t flags, int filter) {
+	// The image is always stretched over the whole element.
+	ImageDisplay *display = (ImageDisplay *) ElementCreate(sizeof(ImageDisplay), parent, flags | ELEMENT_OPAQUE, _ImageDisplayMessage);
+	display->e.classMessages = MESSAGE_BIT(MSG_PAINT) | MESSAGE_BIT(MSG_LAYOUT) | MESSAGE_BIT(MSG_DESTROY);
+	display->filter = filter;
+	return display;
+}
+
+void ImageDisplaySetImage(ImageDisplay *display, const uint32_t *bits, int width, int height, int stride) {
+	display->bits = width > 0 && height > 0 ? bits : NULL;
+	display->width = width, display->height = height, display->stride = stride;
+	free(display->scaled);
+	display->scaled = NULL;
+	_ImageDisplayScale(display);
+	ElementRepaint(&display->e, NULL);
+}
+
+/////////////////////////////////////////
+// Parallel painting.
+/////////////////////////////////////////
+
+// When enabled with ParallelPaintEnable, large updates are split into tiles that are painted concurrently.
+// Each tile is painted with its own Painter, whose clip is the tile, by a full traversal of the element tree.
+// This means that, for the whole element tree, MSG_PAINT handlers must:
+// - Only write pixels through the Draw* functions, or otherwise stay inside painter->clip.
+// - Not modify elements, call ElementMove/ElementRepaint/ElementCreate/ElementDestroy, or touch other shared state.
+// - Expect to be called several times per frame, and concurrently, with different clips.
+// Handlers that only read their element and draw with the painter, like the ones in this file, are fine.
+
+#define TILE_SIZE (256) // 256x256 pixels is 256 KB, which fits in a typical L2 cache.
+
+void _MutexInit(Mutex *mutex) {
+#ifdef PLATFORM_WIN32
+	InitializeSRWLock(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void _MutexAcquire(Mutex *mutex) {
+#ifdef PLATFORM_WIN32
+	AcquireSRWLockExclusive(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void _MutexRelease(Mutex *mutex) {
+#ifdef PLATFORM_WIN32
+	ReleaseSRWLockExclusive(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void _ConditionInit(Condition *condition) {
+#ifdef PLATFORM_WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+void _ConditionWait(Condition *condition, Mutex *mutex) {
+#ifdef PLATFORM_WIN32
+	SleepConditionVariableSRW(condition, mutex, INFINITE, 0);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void _ConditionBroadcast(Condition *condition) {
+#ifdef PLATFORM_WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+void _ThreadStart(Thread *thread, THREAD_FUNCTION((*function)), void *argument) {
+#ifdef PLATFORM_WIN32
+	*thread = CreateThread(NULL, 0, function, argument, 0, NULL);
+#else
+	pthread_create(thread, NULL, function, argument);
+#endif
+}
+
+void _ThreadJoin(Thread thread) {
+#ifdef PLATFORM_WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
 
-	if (parent) {
-		element->window = parent->window;
-		element->parent = parent;
-		parent->childCount++;
-		parent->children = realloc(parent->children, sizeof(Element *) * parent->childCount);
-		parent->children[parent->childCount - 1] = element;
+bool _AtomicCompareExchange64(volatile uint64_t *pointer, uint64_t expected, uint64_t desired) {
+#ifdef _MSC_VER
+	return (uint64_t) InterlockedCompareExchange64((volatile LONG64 *) pointer, (LONG64) desired, (LONG64) expected) == expected;
+#else
+	return __atomic_compare_exchange_n(pointer, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+uint64_t _AtomicLoad64(volatile uint64_t *pointer) {
+#ifdef _MSC_VER
+	return *pointer;
+#else
+	return __atomic_load_n(pointer, __ATOMIC_ACQUIRE);
+#endif
+}
+
+bool _ParallelTakeTile(PaintWorker *worker, bool steal, uint32_t *tile) {
+	while (true) {
+		uint64_t range = _AtomicLoad64(&worker->range);
+		uint32_t next = (uint32_t) range, end = (uint32_t) (range >> 32);
+
+		if (next >= end) {
+			return false;
+		}
+
+		uint64_t desired = steal ? ((uint64_t) (end - 1) << 32 | next) : ((uint64_t) end << 32 | (next + 1));
+
+		if (_AtomicCompareExchange64(&worker->range, range, desired)) {
+			*tile = steal ? end - 1 : next;
+			return true;
+		}
 	}
+}
 
-	return element;
+void _ParallelPaintTiles(int self) {
+	ParallelPaint *parallel = &global.parallel;
+	Painter painter = { 0 };
+	painter.bits = parallel->window->bits;
+	painter.stride = parallel->window->stride;
+	painter.height = parallel->window->height;
+	uint32_t tile;
+
+	// Paint our own tiles, and then help the other workers with theirs.
+	for (int i = 0; i < parallel->threadCount; i++) {
+		PaintWorker *worker = &parallel->workers[(self + i) % parallel->threadCount];
+
+		while (_ParallelTakeTile(worker, i != 0, &tile)) {
+			painter.clip = parallel->tiles[tile];
+			_ElementPaint(&parallel->window->e, &painter);
+		}
+	}
+
+#ifdef _MSC_VER
+	InterlockedExchangeAdd64((volatile LONG64 *) &parallel->pixelsDrawn, (LONG64) painter.pixelsDrawn);
+#else
+	__atomic_fetch_add(&parallel->pixelsDrawn, painter.pixelsDrawn, __ATOMIC_RELAXED);
+#endif
+}
+
+THREAD_FUNCTION(_ParallelWorkerThread) {
+	ParallelPaint *parallel = &global.parallel;
+	int self = (int) (intptr_t) argument;
+	uint64_t generation = 0;
+	_MutexAcquire(&parallel->mutex);
+
+	while (true) {
+		while (parallel->generation == generation && !parallel->quit) {
+			_ConditionWait(&parallel->start, &parallel->mutex);
+		}
+
+		if (parallel->quit) {
+			break;
+		}
+
+		generation = parallel->generation;
+		_MutexRelease(&parallel->mutex);
+		_ParallelPaintTiles(self);
+		_MutexAcquire(&parallel->mutex);
+		parallel->running--;
+		if (!parallel->running) _ConditionBroadcast(&parallel->done);
+	}
+
+	_MutexRelease(&parallel->mutex);
+	return 0;
+}
+
+void _ParallelPaint(Window *window) {
+	ParallelPaint *parallel = &global.parallel;
+	parallel->window = window;
+	parallel->tileCount = 0;
+
+	// Split the damage rectangles along a fixed grid, so that tiles don't straddle grid lines.
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		Rectangle r = window->updateRegion.rectangles[i];
+
+		for (int y = r.t / TILE_SIZE * TILE_SIZE; y < r.b; y += TILE_SIZE) {
+			for (int x = r.l / TILE_SIZE * TILE_SIZE; x < r.r; x += TILE_SIZE) {
+				if (parallel->tileCount == parallel->tileCapacity) {
+					parallel->tileCapacity = parallel->tileCapacity ? parallel->tileCapacity * 2 : 64;
+					parallel->tiles = (Rectangle *) realloc(parallel->tiles, parallel->tileCapacity * sizeof(Rectangle));
+				}
+
+				parallel->tiles[parallel->tileCount++] = RectangleIntersection(r, RectangleMake(x, x + TILE_SIZE, y, y + TILE_SIZE));
+			}
+		}
+	}
+
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		_LayerPrepare(&window->e, window->updateRegion.rectangles[i]);
+	}
+
+	// Give each worker a contiguous run of tiles, so neighbouring tiles are usually painted by the same thread.
+	_MutexAcquire(&parallel->mutex);
+	parallel->painting = true;
+
+	for (int i = 0; i < parallel->threadCount; i++) {
+		uint64_t next = parallel->tileCount * i / parallel->threadCount;
+		uint64_t end = parallel->tileCount * (i + 1) / parallel->threadCount;
+		parallel->workers[i].range = end << 32 | next;
+	}
+
+	parallel->running = parallel->threadCount - 1;
+	parallel->pixelsDrawn = 0;
+	parallel->generation++;
+	_ConditionBroadcast(&parallel->start);
+	_MutexRelease(&parallel->mutex);
+
+	_ParallelPaintTiles(0);
+
+	_MutexAcquire(&parallel->mutex);
+	while (parallel->running) _ConditionWait(&parallel->done, &parallel->mutex);
+	parallel->painting = false;
+	_MutexRelease(&parallel->mutex);
+}
+
+void ParallelPaintEnable(int threadCount) {
+	ParallelPaint *parallel = &global.parallel;
+	if (threadCount > PARALLEL_MAX_THREADS) threadCount = PARALLEL_MAX_THREADS;
+
+	if (parallel->threadCount > 1) {
+		_MutexAcquire(&parallel->mutex);
+		parallel->quit = true;
+		_ConditionBroadcast(&parallel->start);
+		_MutexRelease(&parallel->mutex);
+
+		for (int i = 1; i < parallel->threadCount; i++) {
+			_ThreadJoin(parallel->workers[i].thread);
+		}
+	} else if (!parallel->threadCount) {
+		_MutexInit(&parallel->mutex);
+		_ConditionInit(&parallel->start);
+		_ConditionInit(&parallel->done);
+	}
+
+	parallel->quit = false;
+	parallel->generation = 0;
+	parallel->threadCount = threadCount > 1 ? threadCount : 1;
+
+	// Worker 0 is the thread calling _Update.
+	for (int i = 1; i < parallel->threadCount; i++) {
+		_ThreadStart(&parallel->workers[i].thread, _ParallelWorkerThread, (void *) (intptr_t) i);
+	}
+}
+
+/////////////////////////////////////////
+// Presentation.
+/////////////////////////////////////////
+
+// When enabled with PresentThreadEnable, _Update copies the damaged pixels of each frame into a free present buffer,
+// and queues it for the present thread, instead of waiting for the platform to take the pixels from the window's bits.
+// The window's bits are never read by the present thread, so painting continues into them as before.
+// Each buffer keeps the size of the frame it holds, so frames queued before a resize are presented as they were painted.
+
+THREAD_FUNCTION(_PresentThread) {
+	(void) argument;
+	PresentThread *present = &global.present;
+	_MutexAcquire(&present->mutex);
+
+	while (true) {
+		while (!present->queueCount && !present->quit) {
+			_ConditionWait(&present->queued, &present->mutex);
+		}
+
+		if (!present->queueCount) {
+			break;
+		}
+
+		PresentBuffer *buffer = present->queue[present->queueStart];
+		_MutexRelease(&present->mutex);
+		_WindowPresent(buffer);
+		uint64_t now = _TimeMicroseconds();
+		_MutexAcquire(&present->mutex);
+
+		if (buffer->inputTime) {
+			_InputLatency(now - buffer->inputTime);
+		}
+
+		present->queueStart = (present->queueStart + 1) % (PRESENT_MAX_BUFFERS - 1);
+		present->queueCount--;
+		buffer->busy = false;
+		_ConditionBroadcast(&present->presented);
+	}
+
+	_MutexRelease(&present->mutex);
+	return 0;
+}
+
+void _PresentQueue(Window *window) {
+	PresentThread *present = &global.present;
+	PresentBuffer *buffer = NULL;
+	_MutexAcquire(&present->mutex);
+
+	// Reuse the first buffer the present thread has finished with; with all of them queued, painting is too far ahead.
+	while (!buffer) {
+		for (int i = 0; i < present->bufferCount - 1 && !buffer; i++) {
+			if (!present->buffers[i].busy) buffer = &present->buffers[i];
+		}
+
+		if (!buffer) _ConditionWait(&present->presented, &present->mutex);
+	}
+
+	_MutexRelease(&present->mutex);
+
+	_PresentBufferReserve(buffer, window->stride, window->height);
+	buffer->window = window;
+	buffer->width = window->width;
+	buffer->height = window->height;
+	buffer->stride = window->stride;
+	buffer->region = window->updateRegion;
+	buffer->inputTime = window->inputTime;
+	window->inputTime = 0;
+
+	for (int i = 0; i < buffer->region.count; i++) {
+		Rectangle r = buffer->region.rectangles[i];
+
+		for (int y = r.t; y < r.b; y++) {
+			size_t offset = (size_t) y * window->stride + r.l;
+			memcpy(buffer->bits + offset, window->bits + offset, (r.r - r.l) * 4);
+		}
+	}
+
+	_MutexAcquire(&present->mutex);
+	buffer->busy = true;
+	present->queue[(present->queueStart + present->queueCount) % (PRESENT_MAX_BUFFERS - 1)] = buffer;
+	present->queueCount++;
+	_ConditionBroadcast(&present->queued);
+	_MutexRelease(&present->mutex);
+}
+
+#ifndef USE_XSHM
+
+// Without shared memory, the present buffers are plain memory.
+void _PresentBufferReserve(PresentBuffer *buffer, int stride, int height) {
+	size_t pixels = (size_t) stride * height;
+
+	if (buffer->capacity < pixels) {
+		free(buffer->bits);
+		buffer->bits = (uint32_t *) malloc(pixels * 4);
+		buffer->capacity = pixels;
+	}
+}
+
+void _PresentBufferFree(PresentBuffer *buffer) {
+	free(buffer->bits);
+	buffer->bits = NULL;
+	buffer->capacity = 0;
+}
+
+#endif
+
+// Waits until every queued frame has been presented.
+void _PresentFlush() {
+	PresentThread *present = &global.present;
+
+	if (present->bufferCount > 1) {
+		_MutexAcquire(&present->mutex);
+		while (present->queueCount) _ConditionWait(&present->presented, &present->mutex);
+		_MutexRelease(&present->mutex);
+	}
+}
+
+void PresentThreadEnable(int bufferCount) {
+	PresentThread *present = &global.present;
+	if (bufferCount > PRESENT_MAX_BUFFERS) bufferCount = PRESENT_MAX_BUFFERS;
+
+	if (present->bufferCount > 1) {
+		_PresentFlush();
+		_MutexAcquire(&present->mutex);
+		present->quit = true;
+		_ConditionBroadcast(&present->queued);
+		_MutexRelease(&present->mutex);
+		_ThreadJoin(present->thread);
+	} else if (!present->initialised) {
+		_MutexInit(&present->mutex);
+		_ConditionInit(&present->queued);
+		_ConditionInit(&present->presented);
+		present->initialised = true;
+	}
+
+	for (int i = 0; i < PRESENT_MAX_BUFFERS - 1; i++) {
+		_PresentBufferFree(&present->buffers[i]);
+	}
+
+	present->quit = false;
+	present->bufferCount = bufferCount > 1 ? bufferCount : 0;
+	if (present->bufferCount) _ThreadStart(&present->thread, _PresentThread, NULL);
+}
+
+/////////////////////////////////////////
+// Timers and posted messages.
+/////////////////////////////////////////
+
+// Each platform's MessageLoop sends the due timers and the posted messages, and then paints at most one frame.
+// So many elements animating on timers cost one _Update per frame between them, not one each.
+
+void _MessageLoopWake();
+
+void MessageLoopSetFrameInterval(uint64_t microseconds) {
+	global.frameInterval = microseconds;
+	_MessageLoopWake(); // The loop may be asleep until the next frame at the old interval.
+}
+
+void _TimerSwap(size_t a, size_t b) {
+	Timer swap = global.timers[a];
+	global.timers[a] = global.timers[b];
+	global.timers[b] = swap;
+}
+
+void _TimerSiftUp(size_t index) {
+	while (index && global.timers[(index - 1) / 2].deadline > global.timers[index].deadline) {
+		_TimerSwap(index, (index - 1) / 2);
+		index = (index - 1) / 2;
+	}
+}
+
+void _TimerSiftDown(size_t index) {
+	while (true) {
+		size_t smallest = index, left = index * 2 + 1, right = index * 2 + 2;
+		if (left < global.timerCount && global.timers[left].deadline < global.timers[smallest].deadline) smallest = left;
+		if (right < global.timerCount && global.timers[right].deadline < global.timers[smallest].deadline) smallest = right;
+		if (smallest == index) return;
+		_TimerSwap(index, smallest);
+		index = smallest;
+	}
+}
+
+void _TimerRemove(size_t index) {
+	global.timers[index] = global.timers[--global.timerCount];
+
+	if (index < global.timerCount) {
+		_TimerSiftUp(index);
+		_TimerSiftDown(index);
+	}
+}
+
+uint32_t ElementStartTimer(Element *element, uint32_t milliseconds, bool repeat) {
+	if (global.timerCount == global.timerCapacity) {
+		global.timerCapacity = global.timerCapacity ? global.timerCapacity * 2 : 16;
+		global.timers = (Timer *) realloc(global.timers, global.timerCapacity * sizeof(Timer));
+	}
+
+	if (repeat && !milliseconds) milliseconds = 1; // Otherwise it would always be due.
+	Timer *timer = &global.timers[global.timerCount++];
+	timer->element = element;
+	timer->interval = repeat ? (uint64_t) milliseconds * 1000 : 0;
+	timer->deadline = _TimeMicroseconds() + (uint64_t) milliseconds * 1000;
+	timer->id = ++global.nextTimerID;
+	element->flags |= ELEMENT_HAS_TIMERS;
+	_TimerSiftUp(global.timerCount - 1);
+	return timer->id;
+}
+
+void ElementStopTimer(Element *element, uint32_t id) {
+	for (size_t i = 0; i < global.timerCount; i++) {
+		if (global.timers[i].id == id && global.timers[i].element == element) {
+			_TimerRemove(i);
+			return;
+		}
+	}
+}
+
+// Sends MSG_TIMER for each timer due by now.
+void _TimersFire(uint64_t now) {
+	while (global.timerCount && global.timers[0].deadline <= now) {
+		Timer timer = global.timers[0];
+
+		if (timer.interval) {
+			// Skip the ticks that were missed, rather than sending them all at once.
+			global.timers[0].deadline += timer.interval;
+			if (global.timers[0].deadline <= now) global.timers[0].deadline = now + timer.interval;
+			_TimerSiftDown(0);
+		} else {
+			_TimerRemove(0);
+		}
+
+		global.stats.timersFired++;
+		ElementMessage(timer.element, MSG_TIMER, (int) timer.id, NULL);
+	}
+}
+
+void ElementPostMessage(Element *element, Message message, int di, void *dp) {
+	_MutexAcquire(&global.postedMutex);
+
+	if (global.postedCount == global.postedCapacity) {
+		global.postedCapacity = global.postedCapacity ? global.postedCapacity * 2 : 16;
+		global.posted = (PostedMessage *) realloc(global.posted, global.postedCapacity * sizeof(PostedMessage));
+	}
+
+	PostedMessage *posted = &global.posted[global.postedCount];
+	posted->element = element;
+	posted->message = message;
+	posted->di = di;
+	posted->dp = dp;
+	global.postedCount++;
+	_MutexRelease(&global.postedMutex);
+	_MessageLoopWake();
+}
+
+// Sends the messages posted so far; ones posted meanwhile wait for the next call.
+void _MessageQueueDispatch() {
+	if (!_AtomicLoad64(&global.postedCount)) {
+		return;
+	}
+
+	_MutexAcquire(&global.postedMutex);
+	PostedMessage *messages = global.posted;
+	size_t count = global.postedCount;
+	global.posted = NULL;
+	global.postedCount = global.postedCapacity = 0;
+	_MutexRelease(&global.postedMutex);
+
+	global.dispatching = messages;
+	global.dispatchingCount = count;
+
+	for (size_t i = 0; i < count; i++) {
+		// The element is cleared if it was destroyed by an earlier message.
+		if (messages[i].element) ElementMessage(messages[i].element, messages[i].message, messages[i].di, messages[i].dp);
+	}
+
+	global.dispatching = NULL;
+	global.dispatchingCount = 0;
+	free(messages);
+}
+
+// Drops the element's timers and posted messages when it is freed.
+void _MessageQueueForget(Element *element) {
+	if (element->flags & ELEMENT_HAS_TIMERS) {
+		size_t kept = 0;
+
+		for (size_t i = 0; i < global.timerCount; i++) {
+			if (global.timers[i].element != element) global.timers[kept++] = global.timers[i];
+		}
+
+		global.timerCount = kept;
+		for (size_t i = kept / 2; i > 0; i--) _TimerSiftDown(i - 1);
+	}
+
+	for (size_t i = 0; i < global.dispatchingCount; i++) {
+		if (global.dispatching[i].element == element) global.dispatching[i].element = NULL;
+	}
+
+	if (_AtomicLoad64(&global.postedCount)) {
+		_MutexAcquire(&global.postedMutex);
+
+		for (size_t i = 0; i < global.postedCount; i++) {
+			if (global.posted[i].element == element) global.posted[i].element = NULL;
+		}
+
+		_MutexRelease(&global.postedMutex);
+	}
+}
+
+/////////////////////////////////////////
+// Input recording and replay.
+/////////////////////////////////////////
+
+void _InputWriteNumber(FILE *file, uint64_t value) {
+	uint8_t bytes[10];
+	int count = 0;
+
+	do {
+		bytes[count] = (uint8_t) (value & 0x7F);
+		value >>= 7;
+		if (value) bytes[count] |= 0x80;
+		count++;
+	} while (value);
+
+	fwrite(bytes, 1, count, file);
+}
+
+bool _InputReadNumber(const uint8_t **position, const uint8_t *end, uint64_t *value) {
+	*value = 0;
+
+	for (int shift = 0; *position < end && shift < 64; shift += 7) {
+		uint8_t byte = *(*position)++;
+		*value |= (uint64_t) (byte & 0x7F) << shift;
+		if (~byte & 0x80) return true;
+	}
+
+	return false;
+}
+
+// Events are timed from when they were dequeued, so the time spent handling earlier events counts towards their latency.
+// Anything else, like a replayed event or a message the system sends straight to the window, is timed from now.
+uint64_t _InputArrivalTime() {
+	return global.input.arrivalTime ? global.input.arrivalTime : _TimeMicroseconds();
+}
+
+// Recordings refer to windows by ordinal relative to this, so a replay into freshly created windows finds the same ones.
+uint64_t _InputFirstOrdinal() {
+	uint64_t first = global.windowsCreated;
+
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		if (global.windows[i]->ordinal < first) first = global.windows[i]->ordinal;
+	}
+
+	return first;
+}
+
+void _InputRecord(Window *window, int type, int a, int b) {
+	if (!global.input.file || global.input.replaying) {
+		return;
+	}
+
+	uint64_t now = _InputArrivalTime();
+	if (now < global.input.lastTime) now = global.input.lastTime; // Recording started while the event was being handled.
+	fputc(type, global.input.file);
+	_InputWriteNumber(global.input.file, window->ordinal - global.input.firstOrdinal);
+	_InputWriteNumber(global.input.file, now - global.input.lastTime);
+	_InputWriteNumber(global.input.file, ((uint32_t) a << 1) ^ (uint32_t) (a >> 31));
+	_InputWriteNumber(global.input.file, ((uint32_t) b << 1) ^ (uint32_t) (b >> 31));
+	global.input.lastTime = now;
+}
+
+// Called as each frame that followed input is presented; from the present thread, with its mutex held, if there is one.
+void _InputLatency(uint64_t latency) {
+	global.stats.inputLatency = latency;
+	global.stats.inputLatencyTotal += latency;
+	global.stats.inputLatencyFrames++;
+
+	if (global.input.replaying) {
+		if (global.input.latencyCount == global.input.latencyCapacity) {
+			global.input.latencyCapacity = global.input.latencyCapacity ? global.input.latencyCapacity * 2 : 256;
+			global.input.latencies = (uint64_t *) realloc(global.input.latencies, global.input.latencyCapacity * sizeof(uint64_t));
+		}
+
+		global.input.latencies[global.input.latencyCount++] = latency;
+	}
+}
+
+bool InputRecordStart(FILE *file) {
+	InputRecordStop();
+	if (fwrite(INPUT_RECORD_MAGIC, 1, 8, file) != 8) return false;
+	global.input.file = file;
+	global.input.lastTime = _TimeMicroseconds();
+	global.input.firstOrdinal = _InputFirstOrdinal();
+	return true;
+}
+
+void InputRecordStop() {
+	if (global.input.file) fflush(global.input.file);
+	global.input.file = NULL;
+}
+
+int _InputCompareLatencies(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+bool InputReplay(FILE *file, bool realTime, InputReplayReport *report) {
+	// Read the whole recording first, so the file isn't read in the middle of the timing.
+	uint8_t *data = NULL;
+	size_t bytes = 0, capacity = 0;
+
+	while (!feof(file) && !ferror(file)) {
+		if (bytes == capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			data = (uint8_t *) realloc(data, capacity);
+		}
+
+		bytes += fread(data + bytes, 1, capacity - bytes, file);
+	}
+
+	if (bytes < 8 || memcmp(data, INPUT_RECORD_MAGIC, 8)) {
+		free(data);
+		return false;
+	}
+
+	memset(report, 0, sizeof(InputReplayReport));
+	_PresentFlush(); // The present thread only reads these while presenting.
+	global.input.replaying = true;
+	global.input.latencyCount = 0;
+	uint64_t firstOrdinal = _InputFirstOrdinal();
+	uint64_t frames = global.stats.frames, start = _TimeMicroseconds(), time = 0;
+	const uint8_t *position = data + 8, *end = data + bytes;
+	bool valid = true;
+
+	while (position < end) {
+		int type = *position++;
+		uint64_t ordinal, delta, a, b;
+
+		if (!_InputReadNumber(&position, end, &ordinal) || !_InputReadNumber(&position, end, &delta) || !_InputReadNumber(&position, end, &a) || !_InputReadNumber(&position, end, &b)) {
+			valid = false;
+			break;
+		}
+
+		time += delta;
+
+		if (realTime && _TimeMicroseconds() < start + time) {
+			// Like MessageLoop, paint what has changed before waiting for the next event.
+			_MessageQueueDispatch();
+			_TimersFire(_TimeMicroseconds());
+			_Update();
+			uint64_t now = _TimeMicroseconds();
+			if (now < start + time) _SleepMicroseconds(start + time - now);
+		}
+
+		Window *window = _WindowMapFind(&global.windowOrdinals, (uintptr_t) (firstOrdinal + ordinal + 1));
+
+		if (!window) {
+			report->skipped++;
+			continue;
+		}
+
+		int x = (int) ((uint32_t) a >> 1 ^ -(uint32_t) (a & 1)), y = (int) ((uint32_t) b >> 1 ^ -(uint32_t) (b & 1));
+
+		if (type == INPUT_RECORD_MOVE) {
+			window->cursorX = x;
+			window->cursorY = y;
+			_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
+		} else if (type == INPUT_RECORD_RESIZE) {
+			if (x > 0 && y > 0) _WindowResize(window, x, y);
+		} else if (type == INPUT_RECORD_EXPOSE) {
+			DamageRegion region = { 0 };
+			DamageAdd(&region, window->e.bounds);
+			_WindowExpose(window, &region);
+		}
+
+		report->events++;
+		if (!realTime) _Update();
+	}
+
+	_MessageQueueDispatch();
+	_Update();
+	_PresentFlush();
+	global.input.replaying = false;
+	free(data);
+
+	report->seconds = (_TimeMicroseconds() - start) / 1e6;
+	report->frames = global.stats.frames - frames;
+	size_t count = global.input.latencyCount;
+
+	if (count) {
+		uint64_t *latencies = global.input.latencies;
+		qsort(latencies, count, sizeof(uint64_t), _InputCompareLatencies);
+		report->latencyP50 = latencies[(count - 1) * 50 / 100];
+		report->latencyP90 = latencies[(count - 1) * 90 / 100];
+		report->latencyP99 = latencies[(count - 1) * 99 / 100];
+		report->latencyMax = latencies[count - 1];
+	}
+
+	return valid;
 }
 
 /////////////////////////////////////////
@@ -388,6 +3543,29 @@ Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHan
 
 #ifdef PLATFORM_WIN32
 
+void _WindowResize(Window *window, int width, int height) {
+	_InputRecord(window, INPUT_RECORD_RESIZE, width, height);
+	_WindowResizeBits(window, width, height);
+	window->e.bounds = RectangleMake(0, window->width, 0, window->height);
+	window->e.clip = RectangleMake(0, window->width, 0, window->height);
+	ElementRelayout(&window->e);
+}
+
+// Presents the region of the window again, after WM_PAINT has validated it.
+void _WindowExpose(Window *window, DamageRegion *region) {
+	_InputRecord(window, INPUT_RECORD_EXPOSE, 0, 0);
+	_WindowExposePaint(window, region);
+	_PresentFlush(); // Queued frames are older than the bits.
+	PresentBuffer buffer = { 0 };
+	buffer.window = window;
+	buffer.bits = window->bits;
+	buffer.width = window->width;
+	buffer.height = window->height;
+	buffer.stride = window->stride;
+	buffer.region = *region;
+	_WindowPresent(&buffer);
+}
+
 LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
 	Window *window = (Window *) GetWindowLongPtr(hwnd, GWLP_USERDATA);
 
@@ -396,16 +3574,12 @@ LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 	}
 
 	if (message == WM_CLOSE) {
-		PostQuitMessage(0);
+		WindowDestroy(window);
+		if (!global.windowCount) PostQuitMessage(0);
 	} else if (message == WM_SIZE) {
 		RECT client;
 		GetClientRect(hwnd, &client);
-		window->width = client.right;
-		window->height = client.bottom;
-		window->bits = (uint32_t *) realloc(window->bits, window->width * window->height * 4);
-		window->e.bounds = RectangleMake(0, window->width, 0, window->height);
-		window->e.clip = RectangleMake(0, window->width, 0, window->height);
-		ElementMessage(&window->e, MSG_LAYOUT, 0, 0);
+		_WindowResize(window, client.right, client.bottom);
 		_Update();
 	} else if (message == WM_MOUSEMOVE) {
 		if (!window->trackingLeave) {
@@ -423,22 +3597,22 @@ LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 		window->cursorX = cursor.x;
 		window->cursorY = cursor.y;
 		_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
+		_Update();
 	} else if (message == WM_MOUSELEAVE) {
 		window->trackingLeave = false;
 		window->cursorX = -1;
 		window->cursorY = -1;
 		_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
+		_Update();
 	} else if (message == WM_PAINT) {
+		// Without CS_HREDRAW and CS_VREDRAW, resizing only invalidates the newly exposed area.
 		PAINTSTRUCT paint;
-		HDC dc = BeginPaint(hwnd, &paint);
-		BITMAPINFOHEADER info = { 0 };
-		info.biSize = sizeof(info);
-		info.biWidth = window->width, info.biHeight = -window->height;
-		info.biPlanes = 1, info.biBitCount = 32;
-		StretchDIBits(dc, 0, 0, window->e.bounds.r - window->e.bounds.l, window->e.bounds.b - window->e.bounds.t, 
-				0, 0, window->e.bounds.r - window->e.bounds.l, window->e.bounds.b - window->e.bounds.t,
-				window->bits, (BITMAPINFO *) &info, DIB_RGB_COLORS, SRCCOPY);
+		BeginPaint(hwnd, &paint);
 		EndPaint(hwnd, &paint);
+		DamageRegion region = { 0 };
+		DamageAdd(&region, RectangleIntersection(window->e.bounds, 
+				RectangleMake(paint.rcPaint.left, paint.rcPaint.right, paint.rcPaint.top, paint.rcPaint.bottom)));
+		if (region.count) _WindowExpose(window, &region);
 	} else {
 		return DefWindowProc(hwnd, message, wParam, lParam);
 	}
@@ -450,37 +3624,68 @@ int _WindowMessage(Element *element, Message message, int di, void *dp) {
 	(void) di;
 	(void) dp;
 
-	if (message == MSG_LAYOUT && element->childCount) {
-		ElementMove(element->children[0], element->bounds, false);
-		ElementRepaint(element, NULL);
+	if (message == MSG_LAYOUT && element->childCount) {
+		ElementMove(element->children[0], element->bounds, false);
+		_WindowRepaintAfterLayout((Window *) element);
+	}
+
+	return 0;
+}
+
+void _WindowBeginPaint(Window *window) {
+	(void) window;
+}
+
+void _WindowPresent(PresentBuffer *buffer) {
+	HDC dc = GetDC(buffer->window->hwnd);
+	BITMAPINFOHEADER info = { 0 };
+	info.biSize = sizeof(info);
+	info.biWidth = buffer->stride, info.biHeight = buffer->height;
+	info.biPlanes = 1, info.biBitCount = 32;
+
+	for (int i = 0; i < buffer->region.count; i++) {
+		Rectangle r = buffer->region.rectangles[i];
+		StretchDIBits(dc, 
+			r.l, r.t, r.r - r.l, r.b - r.t,
+			r.l, r.b + 1, r.r - r.l, r.t - r.b,
+			buffer->bits, (BITMAPINFO *) &info, DIB_RGB_COLORS, SRCCOPY);
 	}
 
-	return 0;
+	ReleaseDC(buffer->window->hwnd, dc);
 }
 
 void _WindowEndPaint(Window *window, Painter *painter) {
 	(void) painter;
+	PresentBuffer buffer = { 0 };
+	buffer.window = window;
+	buffer.bits = window->bits;
+	buffer.width = window->width;
+	buffer.height = window->height;
+	buffer.stride = window->stride;
+	buffer.region = window->updateRegion;
+	_WindowPresent(&buffer);
+}
+
+void _WindowScroll(Window *window, Rectangle destination, int dx, int dy) {
 	HDC dc = GetDC(window->hwnd);
-	BITMAPINFOHEADER info = { 0 };
-	info.biSize = sizeof(info);
-	info.biWidth = window->width, info.biHeight = window->height;
-	info.biPlanes = 1, info.biBitCount = 32;
-	StretchDIBits(dc, 
-		window->updateRegion.l, window->updateRegion.t, 
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.b - window->updateRegion.t,
-		window->updateRegion.l, window->updateRegion.b + 1, 
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.t - window->updateRegion.b,
-		window->bits, (BITMAPINFO *) &info, DIB_RGB_COLORS, SRCCOPY);
+	RECT scroll = { destination.l - dx, destination.t - dy, destination.r, destination.b };
+	if (dx < 0) scroll.left = destination.l, scroll.right = destination.r - dx;
+	if (dy < 0) scroll.top = destination.t, scroll.bottom = destination.b - dy;
+	RECT update;
+
+	// Parts of the source that were covered by another window come back as the update rectangle.
+	if (ScrollDC(dc, dx, dy, &scroll, &scroll, NULL, &update) && update.right > update.left && update.bottom > update.top) {
+		Rectangle r = RectangleMake(update.left, update.right, update.top, update.bottom);
+		ElementRepaint(&window->e, &r);
+	}
+
 	ReleaseDC(window->hwnd, dc);
 }
 
 Window *WindowCreate(const char *cTitle, int width, int height) {
 	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, 0, _WindowMessage);
-	window->hovered = &window->e;
-	window->e.window = window;
-	global.windowCount++;
-	global.windows = realloc(global.windows, sizeof(Window *) * global.windowCount);
-	global.windows[global.windowCount - 1] = window;
+	window->e.classMessages = MESSAGE_BIT(MSG_LAYOUT);
+	_WindowAdd(window);
 
 	window->hwnd = CreateWindow("UILibraryTutorial", cTitle, WS_OVERLAPPEDWINDOW, 
 			CW_USEDEFAULT, CW_USEDEFAULT, width, height, NULL, NULL, NULL, NULL);
@@ -490,18 +3695,51 @@ Window *WindowCreate(const char *cTitle, int width, int height) {
 	return window;
 }
 
+void WindowDestroy(Window *window) {
+	_PresentFlush();
+	SetWindowLongPtr(window->hwnd, GWLP_USERDATA, 0);
+	DestroyWindow(window->hwnd);
+	free(window->bits);
+	_WindowFree(window);
+}
+
+void _MessageLoopWake() {
+	PostThreadMessage(global.threadID, WM_NULL, 0, 0);
+}
+
 int MessageLoop() {
 	MSG message = { 0 };
 
-	while (GetMessage(&message, NULL, 0, 0)) {
-		TranslateMessage(&message);
-		DispatchMessage(&message);
-	}
+	while (true) {
+		_MessageQueueDispatch();
+		_TimersFire(_TimeMicroseconds());
+		if (_UpdatePending()) _Update();
+
+		// Sleep until a message arrives or the next timer is due.
+		DWORD timeout = INFINITE;
+
+		if (global.timerCount) {
+			uint64_t now = _TimeMicroseconds(), deadline = global.timers[0].deadline;
+			timeout = deadline > now ? (DWORD) ((deadline - now + 999) / 1000) : 0;
+		}
 
-	return message.wParam;
+		MsgWaitForMultipleObjects(0, NULL, FALSE, timeout, QS_ALLINPUT);
+
+		while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE)) {
+			if (message.message == WM_QUIT) return message.wParam;
+			global.input.arrivalTime = _TimeMicroseconds();
+			TranslateMessage(&message);
+			DispatchMessage(&message);
+			global.input.arrivalTime = 0;
+		}
+	}
 }
 
 void Initialise() {
+	_DrawInitialise();
+	_MutexInit(&global.postedMutex);
+	global.threadID = GetCurrentThreadId();
+
 	WNDCLASS windowClass = { 0 };
 	windowClass.lpfnWndProc = _WindowProcedure;
 	windowClass.hCursor = LoadCursor(NULL, IDC_ARROW);
@@ -514,21 +3752,254 @@ void Initialise() {
 #ifdef PLATFORM_LINUX
 
 Window *_FindWindow(X11Window window) {
-	for (uintptr_t i = 0; i < global.windowCount; i++) {
-		if (global.windows[i]->window == window) {
-			return global.windows[i];
-		}
+	return _WindowMapFind(&global.windowMap, window);
+}
+
+#ifdef USE_XSHM
+
+bool _shmAttachFailed;
+
+int _ShmErrorHandler(Display *display, XErrorEvent *error) {
+	(void) display;
+	(void) error;
+	_shmAttachFailed = true;
+	return 0;
+}
+
+Bool _ShmCompletionPredicate(Display *display, XEvent *event, XPointer argument) {
+	(void) display;
+	return event->type == global.shmCompletionEvent 
+		&& ((XShmCompletionEvent *) event)->drawable == ((Window *) argument)->window;
+}
+
+// The server mustn't be reading from the image, see _WindowBeginPaint.
+void _ShmDestroyImage(XImage *image, XShmSegmentInfo *info) {
+	XShmDetach(global.display, info);
+	XSync(global.display, False);
+	XDestroyImage(image); // Only frees the structure, not the shared memory.
+	shmdt(info->shmaddr);
+}
+
+XImage *_ShmCreateImage(XShmSegmentInfo *info, int width, int height) {
+	XImage *image = XShmCreateImage(global.display, global.visual, 24, ZPixmap, NULL, info, width, height);
+	if (!image) return NULL;
+	info->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+
+	if (info->shmid < 0) {
+		XDestroyImage(image);
+		return NULL;
 	}
 
-	return NULL;
+	info->shmaddr = image->data = (char *) shmat(info->shmid, NULL, 0);
+	info->readOnly = False;
+
+	if (info->shmaddr == (char *) -1) {
+		shmctl(info->shmid, IPC_RMID, NULL);
+		XDestroyImage(image);
+		return NULL;
+	}
+
+	// Attaching fails with an X error if the server can't see our memory, e.g. over a network connection.
+	_shmAttachFailed = false;
+	XErrorHandler previousHandler = XSetErrorHandler(_ShmErrorHandler);
+	XShmAttach(global.display, info);
+	XSync(global.display, False);
+	XSetErrorHandler(previousHandler);
+
+	// The segment is freed once both we and the server have detached.
+	shmctl(info->shmid, IPC_RMID, NULL);
+
+	if (_shmAttachFailed) {
+		shmdt(info->shmaddr);
+		XDestroyImage(image);
+		global.shmAvailable = false;
+		return NULL;
+	}
+
+	return image;
+}
+
+#endif
+
+// The image covers the framebuffer's whole capacity; only the part inside the window is ever put.
+void _WindowResizeImage(Window *window, int width, int height) {
+	int stride, rows;
+
+	if (!_FramebufferNeedsResize(window, width, height, &stride, &rows)) {
+		_FramebufferSetSize(window, width, height);
+		return;
+	}
+
+	XImage *image = NULL;
+
+#ifdef USE_XSHM
+	XShmSegmentInfo info;
+	if (global.shmAvailable) image = _ShmCreateImage(&info, stride, rows);
+	bool shm = image != NULL;
+#endif
+
+	if (!image) {
+		char *data = (char *) calloc((size_t) stride * rows, 4);
+		image = XCreateImage(global.display, global.visual, 24, ZPixmap, 0, data, stride, rows, 32, stride * 4);
+	}
+
+	uint32_t *bits = (uint32_t *) image->data;
+	stride = image->bytes_per_line / 4;
+	_FramebufferCopy(window, bits, stride, width, height);
+	_WindowBeginPaint(window);
+
+#ifdef USE_XSHM
+	if (window->shm) {
+		_ShmDestroyImage(window->image, &window->shmInfo);
+	} else
+#endif
+	{
+		XDestroyImage(window->image); // Also frees the old bits.
+	}
+
+#ifdef USE_XSHM
+	if (shm) {
+		window->shmInfo = info;
+		image->obdata = (char *) &window->shmInfo; // XShmCreateImage kept a pointer to the segment information.
+	}
+
+	window->shm = shm;
+#endif
+
+	window->image = image;
+	window->bits = bits;
+	window->stride = stride;
+	window->capacity = (size_t) stride * image->height;
+	_FramebufferSetSize(window, width, height);
+}
+
+void _WindowPutImage(Window *window, Rectangle r, bool last) {
+#ifdef USE_XSHM
+	if (window->shm) {
+		// Ask for a completion event after the last rectangle, so that we know when bits can be safely painted again.
+		// Requests are processed in order, so the earlier rectangles will have been read by then too.
+		XShmPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
+			r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t, last);
+		if (last) window->shmPending++;
+		return;
+	}
+#else
+	(void) last;
+#endif
+
+	XPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
+		r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t);
+}
+
+void _WindowBeginPaint(Window *window) {
+#ifdef USE_XSHM
+	// Once a round trip has finished, the server has handled every put, and sent their completions before the reply.
+	// A completion that's still missing never will arrive, e.g. if the put failed, so stop waiting for it rather than hang.
+	bool synced = false;
+
+	while (window->shmPending) {
+		XEvent event;
+
+		if (XCheckIfEvent(global.display, &event, _ShmCompletionPredicate, (XPointer) window)) {
+			window->shmPending--;
+		} else if (!synced) {
+			XSync(global.display, False);
+			synced = true;
+		} else {
+			window->shmPending = 0;
+		}
+	}
+#else
+	(void) window;
+#endif
 }
 
 void _WindowEndPaint(Window *window, Painter *painter) {
 	(void) painter;
 
-	XPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
-		window->updateRegion.l, window->updateRegion.t, window->updateRegion.l, window->updateRegion.t,
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.b - window->updateRegion.t);
+	// The requests are buffered by Xlib, and sent together by the flush.
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		_WindowPutImage(window, window->updateRegion.rectangles[i], i == window->updateRegion.count - 1);
+	}
+
+	XFlush(global.display);
+}
+
+#ifdef USE_XSHM
+
+// The present buffers are shared memory too when the windows' images can be, so presenting from the thread doesn't send the pixels through the socket.
+// Called on the main thread, while the buffer isn't busy.
+void _PresentBufferReserve(PresentBuffer *buffer, int stride, int height) {
+	// A shared memory image is put using its own row length, so it must match the window's.
+	if (buffer->image ? buffer->image->bytes_per_line == stride * 4 && buffer->image->height >= height : buffer->capacity >= (size_t) stride * height) {
+		return;
+	}
+
+	_PresentBufferFree(buffer);
+	if (global.shmAvailable) buffer->image = _ShmCreateImage(&buffer->shmInfo, stride, height);
+
+	if (buffer->image && buffer->image->bytes_per_line != stride * 4) {
+		_ShmDestroyImage(buffer->image, &buffer->shmInfo);
+		buffer->image = NULL;
+	}
+
+	buffer->bits = buffer->image ? (uint32_t *) buffer->image->data : (uint32_t *) malloc((size_t) stride * height * 4);
+	buffer->capacity = (size_t) stride * height;
+}
+
+// The server has finished reading the buffer, see _WindowPresent.
+void _PresentBufferFree(PresentBuffer *buffer) {
+	if (buffer->image) {
+		_ShmDestroyImage(buffer->image, &buffer->shmInfo);
+		buffer->image = NULL;
+	} else {
+		free(buffer->bits);
+	}
+
+	buffer->bits = NULL;
+	buffer->capacity = 0;
+}
+
+#endif
+
+// Called on the present thread, which is why Initialise enables Xlib's locking.
+void _WindowPresent(PresentBuffer *buffer) {
+#ifdef USE_XSHM
+	if (buffer->image) {
+		for (int i = 0; i < buffer->region.count; i++) {
+			Rectangle r = buffer->region.rectangles[i];
+			XShmPutImage(global.display, buffer->window->window, DefaultGC(global.display, 0), buffer->image, 
+				r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t, False);
+		}
+
+		// The server reads the segment as it handles each put, so once the round trip finishes, the buffer can be reused.
+		// Waiting for a completion event instead would race with MessageLoop, which reads the events on the main thread.
+		XSync(global.display, False);
+	} else
+#endif
+	{
+		XImage *image = XCreateImage(global.display, global.visual, 24, ZPixmap, 0, (char *) buffer->bits, buffer->stride, buffer->height, 32, 0);
+
+		for (int i = 0; i < buffer->region.count; i++) {
+			Rectangle r = buffer->region.rectangles[i];
+			XPutImage(global.display, buffer->window->window, DefaultGC(global.display, 0), image, r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t);
+		}
+
+		XFlush(global.display);
+		image->data = NULL; // Not ours to free.
+		XDestroyImage(image);
+	}
+
+	// While a put blocks on a full socket, Xlib reads incoming events into its queue, where epoll can't see them.
+	// If MessageLoop has already checked the queue, it would sleep with them in it, so wake it up.
+	if (XEventsQueued(global.display, QueuedAlready)) _MessageLoopWake();
+}
+
+void _WindowScroll(Window *window, Rectangle destination, int dx, int dy) {
+	// The server moves its own copy, so nothing is uploaded.
+	// Parts of the source that were covered by another window come back as GraphicsExpose events.
+	XCopyArea(global.display, window->window, window->window, DefaultGC(global.display, 0), 
+		destination.l - dx, destination.t - dy, destination.r - destination.l, destination.b - destination.t, destination.l, destination.t);
 }
 
 int _WindowMessage(Element *element, Message message, int di, void *dp) {
@@ -537,7 +4008,7 @@ int _WindowMessage(Element *element, Message message, int di, void *dp) {
 
 	if (message == MSG_LAYOUT && element->childCount) {
 		ElementMove(element->children[0], element->bounds, false);
-		ElementRepaint(element, NULL);
+		_WindowRepaintAfterLayout((Window *) element);
 	}
 
 	return 0;
@@ -545,15 +4016,15 @@ int _WindowMessage(Element *element, Message message, int di, void *dp) {
 
 Window *WindowCreate(const char *cTitle, int width, int height) {
 	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, 0, _WindowMessage);
-	window->hovered = &window->e;
-	window->e.window = window;
-	global.windowCount++;
-	global.windows = realloc(global.windows, sizeof(Window *) * global.windowCount);
-	global.windows[global.windowCount - 1] = window;
+	window->e.classMessages = MESSAGE_BIT(MSG_LAYOUT);
+	_WindowAdd(window);
 
+	// Keep the window's contents in place when it's resized, so the server only exposes the new strips.
 	XSetWindowAttributes attributes = {};
+	attributes.bit_gravity = NorthWestGravity;
 	window->window = XCreateWindow(global.display, DefaultRootWindow(global.display), 0, 0, width, height, 0, 0, 
-		InputOutput, CopyFromParent, CWOverrideRedirect, &attributes);
+		InputOutput, CopyFromParent, CWOverrideRedirect | CWBitGravity, &attributes);
+	_WindowMapInsert(&global.windowMap, window->window, window);
 	XStoreName(global.display, window->window, cTitle);
 	XSelectInput(global.display, window->window, SubstructureNotifyMask | ExposureMask | PointerMotionMask 
 		| ButtonPressMask | ButtonReleaseMask | KeyPressMask | KeyReleaseMask | StructureNotifyMask
@@ -564,57 +4035,330 @@ Window *WindowCreate(const char *cTitle, int width, int height) {
 	return window;
 }
 
+void WindowDestroy(Window *window) {
+	_PresentFlush();
+	_WindowBeginPaint(window);
+#ifdef USE_XSHM
+	if (window->shm) _ShmDestroyImage(window->image, &window->shmInfo);
+	else
+#endif
+	if (window->image) XDestroyImage(window->image); // Also frees the bits.
+	_WindowMapRemove(&global.windowMap, window->window);
+	XDestroyWindow(global.display, window->window);
+	_WindowFree(window);
+}
+
+void _WindowResize(Window *window, int width, int height) {
+	_InputRecord(window, INPUT_RECORD_RESIZE, width, height);
+	_WindowResizeImage(window, width, height);
+	window->e.bounds = RectangleMake(0, window->width, 0, window->height);
+	window->e.clip = RectangleMake(0, window->width, 0, window->height);
+	ElementRelayout(&window->e);
+}
+
+void _WindowExpose(Window *window, DamageRegion *region) {
+	_InputRecord(window, INPUT_RECORD_EXPOSE, 0, 0);
+	_WindowExposePaint(window, region);
+	_PresentFlush(); // Queued frames are older than the bits.
+
+	for (int i = 0; i < region->count; i++) {
+		_WindowPutImage(window, region->rectangles[i], i == region->count - 1);
+	}
+}
+
+// Returns true if the application should exit.
+bool _HandleEvent(XEvent *event) {
+	if (event->type == ClientMessage && (Atom) event->xclient.data.l[0] == global.windowClosedID) {
+		// Exit once the last window has been closed.
+		Window *window = _FindWindow(event->xclient.window);
+		if (window) WindowDestroy(window);
+		return !global.windowCount;
+	} else if (event->type == Expose) {
+		Window *window = _FindWindow(event->xexpose.window);
+		if (!window) return false;
+		XExposeEvent *expose = &event->xexpose;
+		Rectangle r = RectangleMake(expose->x, expose->x + expose->width, expose->y, expose->y + expose->height);
+		DamageAdd(&window->exposed, RectangleIntersection(window->e.bounds, r));
+
+		// The rectangles of an exposure arrive together, with count saying how many more are to follow.
+		if (expose->count) {
+			global.stats.eventsCoalesced++;
+		} else if (window->exposed.count) {
+			_WindowExpose(window, &window->exposed);
+			window->exposed.count = 0;
+		}
+	} else if (event->type == GraphicsExpose) {
+		Window *window = _FindWindow(event->xgraphicsexpose.drawable);
+		if (!window) return false;
+		XGraphicsExposeEvent *expose = &event->xgraphicsexpose;
+		Rectangle r = RectangleMake(expose->x, expose->x + expose->width, expose->y, expose->y + expose->height);
+		ElementRepaint(&window->e, &r);
+	} else if (event->type == ConfigureNotify) {
+		Window *window = _FindWindow(event->xconfigure.window);
+		if (!window) return false;
+
+		// Only the most recent size matters.
+		while (XCheckTypedWindowEvent(global.display, window->window, ConfigureNotify, event)) {
+			global.stats.eventsCoalesced++;
+		}
+
+		if (window->width != event->xconfigure.width || window->height != event->xconfigure.height) {
+			_WindowResize(window, event->xconfigure.width, event->xconfigure.height);
+		}
+	} else if (event->type == MotionNotify) {
+		Window *window = _FindWindow(event->xmotion.window);
+		if (!window) return false;
+
+		// Skip to the last of a run of consecutive motion events.
+		// Motion after some other event, like a button press, is left alone to keep the order of input.
+		while (XEventsQueued(global.display, QueuedAfterReading)) {
+			XEvent next;
+			XPeekEvent(global.display, &next);
+			if (next.type != MotionNotify || next.xmotion.window != event->xmotion.window) break;
+			XNextEvent(global.display, event);
+			global.stats.eventsCoalesced++;
+		}
+
+		window->cursorX = event->xmotion.x;
+		window->cursorY = event->xmotion.y;
+		_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
+	} else if (event->type == LeaveNotify) {
+		Window *window = _FindWindow(event->xcrossing.window);
+		if (!window) return false;
+		window->cursorX = -1;
+		window->cursorY = -1;
+		_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
+#ifdef USE_XSHM
+	} else if (global.shmCompletionEvent && event->type == global.shmCompletionEvent) {
+		Window *window = _FindWindow(((XShmCompletionEvent *) event)->drawable);
+		if (!window || !window->shmPending) return false;
+		window->shmPending--;
+#endif
+	}
+
+	return false;
+}
+
+void _MessageLoopWake() {
+	uint64_t one = 1;
+	ssize_t written = write(global.wakeFD, &one, sizeof(one));
+	(void) written; // Only fails if the counter is about to overflow, and then the loop is awake anyway.
+}
+
 int MessageLoop() {
 	_Update();
+	uint64_t lastFrame = _TimeMicroseconds();
 
 	while (true) {
-		XEvent event;
-		XNextEvent(global.display, &event);
-
-		if (event.type == ClientMessage && (Atom) event.xclient.data.l[0] == global.windowClosedID) {
-			return 0;
-		} else if (event.type == Expose) {
-			Window *window = _FindWindow(event.xexpose.window);
-			if (!window) continue;
-			XPutImage(global.display, window->window, DefaultGC(global.display, 0), 
-					window->image, 0, 0, 0, 0, window->width, window->height);
-		} else if (event.type == ConfigureNotify) {
-			Window *window = _FindWindow(event.xconfigure.window);
-			if (!window) continue;
-
-			if (window->width != event.xconfigure.width || window->height != event.xconfigure.height) {
-				window->width = event.xconfigure.width;
-				window->height = event.xconfigure.height;
-				window->bits = (uint32_t *) realloc(window->bits, window->width * window->height * 4);
-				window->image->width = window->width;
-				window->image->height = window->height;
-				window->image->bytes_per_line = window->width * 4;
-				window->image->data = (char *) window->bits;
-				window->e.bounds = RectangleMake(0, window->width, 0, window->height);
-				window->e.clip = RectangleMake(0, window->width, 0, window->height);
-				ElementMessage(&window->e, MSG_LAYOUT, 0, 0);
-				_Update();
+		// Handle the events that have already arrived, but not ones that arrive meanwhile, so painting can't be starved.
+		// They have all been read from the connection by the time XPending returns, so that's when they arrived.
+		int budget = XPending(global.display);
+		uint64_t arrived = _TimeMicroseconds();
+
+		for (; budget > 0 && XEventsQueued(global.display, QueuedAlready); budget--) {
+			XEvent event;
+			XNextEvent(global.display, &event);
+			global.input.arrivalTime = arrived;
+			bool quit = _HandleEvent(&event);
+			global.input.arrivalTime = 0;
+			if (quit) return 0;
+		}
+
+		uint64_t now = _TimeMicroseconds();
+		_MessageQueueDispatch();
+		_TimersFire(now);
+
+		if (_UpdatePending() && now - lastFrame >= global.frameInterval) {
+			_Update();
+			lastFrame = now;
+			continue;
+		}
+
+		if (XEventsQueued(global.display, QueuedAfterFlush)) {
+			continue;
+		}
+
+		// Sleep until there's input, a timer is due, the next frame can be painted, or another thread posts a message.
+		uint64_t wake = global.timerCount ? global.timers[0].deadline : 0;
+		uint64_t nextFrame = lastFrame + global.frameInterval;
+		if (_UpdatePending() && (!wake || nextFrame < wake)) wake = nextFrame;
+		struct itimerspec deadline = { 0 }; // Left zero, the timer is disarmed.
+		deadline.it_value.tv_sec = wake / 1000000;
+		deadline.it_value.tv_nsec = wake % 1000000 * 1000;
+		timerfd_settime(global.timerFD, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+		struct epoll_event events[3];
+		int count = epoll_wait(global.epollFD, events, 3, -1);
+
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.fd != ConnectionNumber(global.display)) {
+				uint64_t value;
+				ssize_t bytes = read(events[i].data.fd, &value, sizeof(value));
+				(void) bytes; // Just to clear it.
 			}
-		} else if (event.type == MotionNotify) {
-			Window *window = _FindWindow(event.xmotion.window);
-			if (!window) continue;
-			window->cursorX = event.xmotion.x;
-			window->cursorY = event.xmotion.y;
-			_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
-		} else if (event.type == LeaveNotify) {
-			Window *window = _FindWindow(event.xcrossing.window);
-			if (!window) continue;
-			window->cursorX = -1;
-			window->cursorY = -1;
-			_WindowInputEvent(window, MSG_MOUSE_MOVE, 0, 0);
 		}
 	}
 }
 
 void Initialise() {
+	_DrawInitialise();
+
+	// The present thread shares the connection, if PresentThreadEnable is used.
+	XInitThreads();
 	global.display = XOpenDisplay(NULL);
 	global.visual = XDefaultVisual(global.display, 0);
 	global.windowClosedID = XInternAtom(global.display, "WM_DELETE_WINDOW", 0);
+	global.frameInterval = 1000000 / 60;
+
+#ifdef USE_XSHM
+	// Fall back to XPutImage if the server doesn't support shared memory images.
+	global.shmAvailable = XShmQueryExtension(global.display);
+	if (global.shmAvailable) global.shmCompletionEvent = XShmGetEventBase(global.display) + ShmCompletion;
+#endif
+
+	// Deadlines are from CLOCK_MONOTONIC, like _TimeMicroseconds.
+	_MutexInit(&global.postedMutex);
+	global.epollFD = epoll_create1(EPOLL_CLOEXEC);
+	global.timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	global.wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int descriptors[] = { ConnectionNumber(global.display), global.timerFD, global.wakeFD };
+
+	for (int i = 0; i < 3; i++) {
+		struct epoll_event event = { 0 };
+		event.events = EPOLLIN;
+		event.data.fd = descriptors[i];
+		epoll_ctl(global.epollFD, EPOLL_CTL_ADD, descriptors[i], &event);
+	}
+}
+
+#endif
+
+#ifdef PLATFORM_HEADLESS
+
+// Renders into plain memory with no display connection, for batch rendering and profiling.
+// MessageLoop paints a frame each iteration for as long as global.frameHandler asks for more.
+
+void _WindowBeginPaint(Window *window) {
+	(void) window;
+}
+
+void _WindowPresent(PresentBuffer *buffer) {
+	if (global.presentHandler) {
+		global.presentHandler(buffer->window, buffer->bits, buffer->stride, &buffer->region);
+	}
+}
+
+void _WindowEndPaint(Window *window, Painter *painter) {
+	(void) painter;
+
+	if (global.presentHandler) {
+		global.presentHandler(window, window->bits, window->stride, &window->updateRegion);
+	}
+}
+
+void _WindowScroll(Window *window, Rectangle destination, int dx, int dy) {
+	(void) dx;
+	(void) dy;
+
+	// There's no copy to move, so present the moved pixels as they are.
+	if (global.presentHandler) {
+		DamageRegion region = { 0 };
+		DamageAdd(&region, destination);
+		global.presentHandler(window, window->bits, window->stride, &region);
+	}
+}
+
+int _WindowMessage(Element *element, Message message, int di, void *dp) {
+	(void) di;
+	(void) dp;
+
+	if (message == MSG_LAYOUT && element->childCount) {
+		ElementMove(element->children[0], element->bounds, false);
+		_WindowRepaintAfterLayout((Window *) element);
+	}
+
+	return 0;
+}
+
+void _WindowResize(Window *window, int width, int height) {
+	_InputRecord(window, INPUT_RECORD_RESIZE, width, height);
+	_WindowResizeBits(window, width, height);
+	window->e.bounds = RectangleMake(0, window->width, 0, window->height);
+	window->e.clip = RectangleMake(0, window->width, 0, window->height);
+	ElementRelayout(&window->e);
+}
+
+void WindowResize(Window *window, int width, int height) {
+	_WindowResize(window, width, height);
+}
+
+// There's no display to lose the pixels, but replayed exposes present the region, as on the other platforms.
+void _WindowExpose(Window *window, DamageRegion *region) {
+	_InputRecord(window, INPUT_RECORD_EXPOSE, 0, 0);
+	_WindowExposePaint(window, region);
+	_PresentFlush();
+
+	if (global.presentHandler) {
+		global.presentHandler(window, window->bits, window->stride, region);
+	}
+}
+
+bool WindowWriteFrame(Window *window, FILE *file) {
+	for (int y = 0; y < window->height; y++) {
+		if (fwrite(window->bits + (size_t) y * window->stride, 4, window->width, file) != (size_t) window->width) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+Window *WindowCreate(const char *cTitle, int width, int height) {
+	(void) cTitle;
+	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, 0, _WindowMessage);
+	window->e.classMessages = MESSAGE_BIT(MSG_LAYOUT);
+	_WindowAdd(window);
+	_WindowResizeBits(window, width, height);
+	window->e.bounds = RectangleMake(0, width, 0, height);
+	window->e.clip = RectangleMake(0, width, 0, height);
+	return window;
+}
+
+void WindowDestroy(Window *window) {
+	_PresentFlush();
+	free(window->bits);
+	_WindowFree(window);
+}
+
+int MessageLoop() {
+	// Like the first configure event on the other platforms, lay out the windows once their contents exist.
+	for (uintptr_t i = 0; i < global.windowCount; i++) {
+		ElementRelayout(&global.windows[i]->e);
+	}
+
+	while (!global.frameHandler || global.frameHandler(global.frameCount)) {
+		uint64_t frameStart = _TimeMicroseconds();
+		_MessageQueueDispatch();
+		_TimersFire(frameStart);
+		_Update();
+		global.frameCount++;
+		if (!global.frameHandler) break;
+
+		// With a frame interval, wait out the rest of it, as if for the display.
+		uint64_t now = _TimeMicroseconds();
+		if (now < frameStart + global.frameInterval) _SleepMicroseconds(frameStart + global.frameInterval - now);
+	}
+
+	return 0;
+}
+
+void _MessageLoopWake() {
+	// MessageLoop sends the posted messages before every frame anyway.
+}
+
+void Initialise() {
+	_DrawInitialise();
+	_MutexInit(&global.postedMutex);
 }
 
 #endif
@@ -623,7 +4367,7 @@ void Initialise() {
 // Test usage code.
 /////////////////////////////////////////
 
-#include <stdio.h>
+#ifndef TOY_NO_DEMO
 
 Element *parentElement, *childElement;
 
@@ -656,10 +4400,54 @@ int ChildElementMessage(Element *element, Message message, int di, void *dp) {
 	return 0;
 }
 
-int main() {
+// Pass --record file to save the input, or --replay file [--real-time] to play it back and print the latency.
+int main(int argc, char **argv) {
+	const char *recordPath = NULL, *replayPath = NULL;
+	bool realTime = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--record") && i + 1 < argc) recordPath = argv[++i];
+		else if (0 == strcmp(argv[i], "--replay") && i + 1 < argc) replayPath = argv[++i];
+		else if (0 == strcmp(argv[i], "--real-time")) realTime = true;
+	}
+
 	Initialise();
 	Window *window = WindowCreate("Hello, world", 300, 200);
 	parentElement = ElementCreate(sizeof(Element), &window->e, 0, ParentElementMessage);
-	childElement = ElementCreate(sizeof(Element), parentElement, 0, ChildElementMessage);
-	return MessageLoop();
-}
\ No newline at end of file
+	childElement = ElementCreate(sizeof(Element), parentElement, ELEMENT_OPAQUE, ChildElementMessage);
+	int result = 0;
+
+	if (replayPath) {
+		FILE *file = fopen(replayPath, "rb");
+		InputReplayReport report;
+		ElementRelayout(&window->e);
+
+		if (!file || !InputReplay(file, realTime, &report)) {
+			fprintf(stderr, "Could not replay %s\n", replayPath);
+			result = 1;
+		} else {
+			fprintf(stderr, "replayed %llu events in %.3f s, %llu frames; latency p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+					(unsigned long long) report.events, report.seconds, (unsigned long long) report.frames,
+					(unsigned long long) report.latencyP50, (unsigned long long) report.latencyP90,
+					(unsigned long long) report.latencyP99, (unsigned long long) report.latencyMax);
+		}
+
+		if (file) fclose(file);
+	} else {
+		FILE *file = recordPath ? fopen(recordPath, "wb") : NULL;
+		if (file) InputRecordStart(file);
+		result = MessageLoop();
+		InputRecordStop();
+		if (file) fclose(file);
+	}
+
+#ifdef TOY_TRACE
+	FILE *file = fopen("toy_trace.json", "wb");
+	if (file) TraceWriteJSON(file), fclose(file);
+	TraceWriteHistogram(stderr);
+#endif
+
+	return result;
+}
+
+#endif